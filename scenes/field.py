@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+
+# NOTE: Writes a field of small random spheres on the default ground plane.
+# The seed is fixed so every run of `./bench` sees the same scene.
+
+import random
+import sys
+
+
+def main():
+    n = int(sys.argv[1]) if 1 < len(sys.argv) else 100000
+    random.seed(1)
+    print("surface lambertian 0.675 0.675 0.675")
+    print("surface metal 0.8 0.8 0.8 0.025")
+    print("surface dielectric 1.5")
+    for _ in range(16):
+        print("surface lambertian {:.3f} {:.3f} {:.3f}".format(
+            random.random(),
+            random.random(),
+            random.random(),
+        ))
+    print()
+    print("sphere 0.0 -500.5 -1.0 500.0 0")
+    for _ in range(n):
+        r = random.uniform(0.05, 0.2)
+        print("sphere {:.4f} {:.4f} {:.4f} {:.4f} {}".format(
+            random.uniform(-30.0, 30.0),
+            r - 0.5,
+            random.uniform(-60.0, 0.0),
+            r,
+            random.randrange(1, 19),
+        ))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,6 +1,10 @@
 #ifndef __BMP_H__
 #define __BMP_H__
 
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
 #pragma pack(push, 2)
 
 struct BmpHeader {
@@ -28,44 +32,147 @@ struct Pixel {
 #pragma pack(pop)
 
 #define BMP_HEADER_SIZE (sizeof(BmpHeader) + sizeof(DibHeader))
-#define BMP_FILE_SIZE   (BMP_HEADER_SIZE + sizeof(Pixel[N_PIXELS]))
+#define BMP_ROW_ALIGN   4
 
+// NOTE: Rows are stored bottom-up and each is padded out to
+// `BMP_ROW_ALIGN` bytes, so `stride` only equals `width * sizeof(Pixel)`
+// when that is already a multiple of four. `memory` maps the whole output
+// file and `pixels` points just past its headers.
 struct BmpImage {
-    Pixel     pixels[N_PIXELS];
-    DibHeader dib_header;
     BmpHeader bmp_header;
+    DibHeader dib_header;
+    u8*       memory;
+    u8*       pixels;
+    usize     size;
+    usize     stride;
+    u32       width;
+    u32       height;
+    i32       file;
 };
 
-static void set_bmp_header(BmpHeader* header) {
+static usize get_stride(u32 width) {
+    return ((width * sizeof(Pixel)) + (BMP_ROW_ALIGN - 1)) &
+           ~static_cast<usize>(BMP_ROW_ALIGN - 1);
+}
+
+static Pixel* get_row(BmpImage* image, u32 y) {
+    return reinterpret_cast<Pixel*>(&image->pixels[y * image->stride]);
+}
+
+static void set_bmp_header(BmpHeader* header, usize stride, u32 height) {
     header->id = __builtin_bswap16(0x424D);
-    header->file_size = BMP_FILE_SIZE;
+    header->file_size = static_cast<u32>(BMP_HEADER_SIZE + (stride * height));
     header->header_offset = BMP_HEADER_SIZE;
 }
 
-static void set_dib_header(DibHeader* header) {
+static void set_dib_header(DibHeader* header, u32 width, u32 height) {
     header->header_size = sizeof(DibHeader);
-    header->pixel_width = static_cast<i32>(IMAGE_WIDTH);
-    header->pixel_height = static_cast<i32>(IMAGE_HEIGHT);
+    header->pixel_width = static_cast<i32>(width);
+    header->pixel_height = static_cast<i32>(height);
     header->color_planes = 1;
     header->bits_per_pixel = sizeof(Pixel) * 8;
 }
 
-static void write_bmp(File* file, BmpImage* image) {
-    if (fwrite(&image->bmp_header, 1, sizeof(BmpHeader), file) !=
-        sizeof(BmpHeader))
+// NOTE: The file is sized up front and mapped shared with its headers
+// already in place, so rows written through `get_row` land straight in the
+// page cache and `flush_rows` can push them out while rendering goes on.
+static void open_bmp(BmpImage*   image,
+                     const char* path,
+                     u32         width,
+                     u32         height) {
+    *image = {};
+    image->width = width;
+    image->height = height;
+    image->stride = get_stride(width);
+    image->size = BMP_HEADER_SIZE + (image->stride * height);
+    set_bmp_header(&image->bmp_header, image->stride, height);
+    set_dib_header(&image->dib_header, width, height);
+    image->file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ((image->file < 0) ||
+        (ftruncate(image->file, static_cast<off_t>(image->size)) != 0))
+    {
+        exit(EXIT_FAILURE);
+    }
+    void* memory = mmap(null,
+                        image->size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED,
+                        image->file,
+                        0);
+    if (memory == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    image->memory = reinterpret_cast<u8*>(memory);
+    memcpy(image->memory, &image->bmp_header, sizeof(BmpHeader));
+    memcpy(&image->memory[sizeof(BmpHeader)],
+           &image->dib_header,
+           sizeof(DibHeader));
+    image->pixels = &image->memory[BMP_HEADER_SIZE];
+}
+
+// NOTE: Maps an existing file read-only; only the uncompressed 24-bit
+// bottom-up layout that `open_bmp` writes is accepted.
+static void map_bmp(BmpImage* image, const char* path) {
+    *image = {};
+    image->file = open(path, O_RDONLY);
+    struct stat status;
+    if ((image->file < 0) || (fstat(image->file, &status) != 0) ||
+        (static_cast<usize>(status.st_size) < BMP_HEADER_SIZE))
     {
         exit(EXIT_FAILURE);
     }
-    if (fwrite(&image->dib_header, 1, sizeof(DibHeader), file) !=
-        sizeof(DibHeader))
+    image->size = static_cast<usize>(status.st_size);
+    void* memory =
+        mmap(null, image->size, PROT_READ, MAP_PRIVATE, image->file, 0);
+    if (memory == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    image->memory = reinterpret_cast<u8*>(memory);
+    memcpy(&image->bmp_header, image->memory, sizeof(BmpHeader));
+    memcpy(&image->dib_header,
+           &image->memory[sizeof(BmpHeader)],
+           sizeof(DibHeader));
+    if ((image->dib_header.bits_per_pixel != (sizeof(Pixel) * 8)) ||
+        (image->dib_header.pixel_width <= 0) ||
+        (image->dib_header.pixel_height <= 0))
     {
         exit(EXIT_FAILURE);
     }
-    if (fwrite(&image->pixels, 1, sizeof(Pixel[N_PIXELS]), file) !=
-        sizeof(Pixel[N_PIXELS]))
+    image->width = static_cast<u32>(image->dib_header.pixel_width);
+    image->height = static_cast<u32>(image->dib_header.pixel_height);
+    image->stride = get_stride(image->width);
+    if ((image->size < image->bmp_header.header_offset) ||
+        ((image->size - image->bmp_header.header_offset) <
+         (image->stride * image->height)))
     {
         exit(EXIT_FAILURE);
     }
+    image->pixels = &image->memory[image->bmp_header.header_offset];
+}
+
+// NOTE: Starts writeback of rows `[start, end)` without waiting for it; this
+// is only a hint, the rows reach the file through the mapping regardless.
+static void flush_rows(const BmpImage* image, u32 start, u32 end) {
+    sync_file_range(
+        image->file,
+        static_cast<off_t>(BMP_HEADER_SIZE + (start * image->stride)),
+        static_cast<off_t>((end - start) * image->stride),
+        SYNC_FILE_RANGE_WRITE);
+}
+
+// NOTE: Waits until the whole file has been written back, so a run of
+// images written one after the other never piles up dirty pages.
+static void sync_bmp(const BmpImage* image) {
+    sync_file_range(image->file,
+                    0,
+                    static_cast<off_t>(image->size),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+}
+
+static void close_bmp(BmpImage* image) {
+    munmap(image->memory, image->size);
+    close(image->file);
 }
 
 #endif
@@ -0,0 +1,284 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#define BVH_BINS         16
+#define BVH_MAX_LEAF     16
+#define BVH_STACK        64
+#define BVH_DEPTH        (BVH_STACK - 1)
+#define BVH_TRAVERSAL    16.0f
+#define BVH_INTERSECTION 1.0f
+
+#define BVH_THREAD_THRESHOLD (1 << 12)
+
+struct Aabb {
+    Vec3 min;
+    Vec3 max;
+};
+
+struct BvhNode {
+    Aabb box;
+    u32  offset;
+    u32  count;
+};
+
+struct Bvh {
+    BvhNode* nodes;
+    u32*     indices;
+    u32      n_nodes;
+};
+
+struct BvhEntry {
+    u32 node;
+    f32 t;
+};
+
+struct BvhBin {
+    Aabb box;
+    u32  count;
+};
+
+struct BvhBuild {
+    const Aabb* bounds;
+    const Vec3* centroids;
+    BvhNode*    nodes;
+    u32*        indices;
+    u32Atomic   n_nodes;
+    u32         thread_depth;
+};
+
+struct BvhTask {
+    BvhBuild* build;
+    u32       node;
+    u32       depth;
+};
+
+static Aabb get_empty_box() {
+    return {
+        {F32_MAX, F32_MAX, F32_MAX},
+        {-F32_MAX, -F32_MAX, -F32_MAX},
+    };
+}
+
+static void grow(Aabb* box, Vec3 point) {
+    box->min = min(box->min, point);
+    box->max = max(box->max, point);
+}
+
+static void grow(Aabb* box, const Aabb* other) {
+    box->min = min(box->min, other->min);
+    box->max = max(box->max, other->max);
+}
+
+static f32 get_half_area(const Aabb* box) {
+    const Vec3 extent = box->max - box->min;
+    return (extent.x * extent.y) + (extent.y * extent.z) +
+           (extent.z * extent.x);
+}
+
+static f32 get_axis(Vec3 a, u32 axis) {
+    return axis == 0 ? a.x : axis == 1 ? a.y : a.z;
+}
+
+static u32 get_bin(f32 centroid, f32 lower, f32 scale) {
+    const u32 bin = static_cast<u32>((centroid - lower) * scale);
+    return bin < BVH_BINS ? bin : BVH_BINS - 1;
+}
+
+static void build_node(BvhBuild* build, u32 index, u32 depth);
+
+static void* thread_build(void* payload) {
+    BvhTask* task = reinterpret_cast<BvhTask*>(payload);
+    build_node(task->build, task->node, task->depth);
+    return null;
+}
+
+static void build_node(BvhBuild* build, u32 index, u32 depth) {
+    BvhNode*  node = &build->nodes[index];
+    const u32 first = node->offset;
+    const u32 count = node->count;
+    Aabb      centroid_box = get_empty_box();
+    node->box = get_empty_box();
+    for (u32 i = first; i < first + count; ++i) {
+        grow(&node->box, &build->bounds[build->indices[i]]);
+        grow(&centroid_box, build->centroids[build->indices[i]]);
+    }
+    // NOTE: Traversal keeps at most one sibling per level on its stack, plus
+    // both children of the node it is on, so leaves go no deeper than
+    // `BVH_DEPTH`; a leaf forced early is just tested in full.
+    if ((count <= 1) || (BVH_DEPTH <= depth)) {
+        return;
+    }
+    f32 best_cost = F32_MAX;
+    u32 best_axis = 0;
+    u32 best_split = 0;
+    for (u32 axis = 0; axis < 3; ++axis) {
+        const f32 lower = get_axis(centroid_box.min, axis);
+        const f32 extent = get_axis(centroid_box.max, axis) - lower;
+        if (extent <= 0.0f) {
+            continue;
+        }
+        const f32 scale = static_cast<f32>(BVH_BINS) / extent;
+        BvhBin    bins[BVH_BINS];
+        for (u32 i = 0; i < BVH_BINS; ++i) {
+            bins[i] = {get_empty_box(), 0};
+        }
+        for (u32 i = first; i < first + count; ++i) {
+            const u32 primitive = build->indices[i];
+            BvhBin*   bin = &bins[get_bin(
+                get_axis(build->centroids[primitive], axis),
+                lower,
+                scale)];
+            grow(&bin->box, &build->bounds[primitive]);
+            ++bin->count;
+        }
+        f32  right_areas[BVH_BINS];
+        u32  right_counts[BVH_BINS];
+        Aabb right = get_empty_box();
+        u32  right_count = 0;
+        for (u32 i = BVH_BINS - 1; 0 < i; --i) {
+            grow(&right, &bins[i].box);
+            right_count += bins[i].count;
+            right_areas[i] = get_half_area(&right);
+            right_counts[i] = right_count;
+        }
+        Aabb left = get_empty_box();
+        u32  left_count = 0;
+        for (u32 i = 1; i < BVH_BINS; ++i) {
+            grow(&left, &bins[i - 1].box);
+            left_count += bins[i - 1].count;
+            if ((left_count == 0) || (right_counts[i] == 0)) {
+                continue;
+            }
+            const f32 cost =
+                (static_cast<f32>(left_count) * get_half_area(&left)) +
+                (static_cast<f32>(right_counts[i]) * right_areas[i]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+    const f32 leaf_cost =
+        static_cast<f32>(count) * BVH_INTERSECTION * get_half_area(&node->box);
+    best_cost = (BVH_TRAVERSAL * get_half_area(&node->box)) +
+                (BVH_INTERSECTION * best_cost);
+    u32 middle;
+    if (best_split == 0) {
+        if (count <= BVH_MAX_LEAF) {
+            return;
+        }
+        middle = first + (count / 2);
+    } else {
+        if ((count <= BVH_MAX_LEAF) && (leaf_cost <= best_cost)) {
+            return;
+        }
+        const f32 lower = get_axis(centroid_box.min, best_axis);
+        const f32 scale = static_cast<f32>(BVH_BINS) /
+                          (get_axis(centroid_box.max, best_axis) - lower);
+        u32 i = first;
+        u32 j = first + count;
+        while (i < j) {
+            const f32 centroid =
+                get_axis(build->centroids[build->indices[i]], best_axis);
+            if (get_bin(centroid, lower, scale) < best_split) {
+                ++i;
+            } else {
+                const u32 swap = build->indices[i];
+                build->indices[i] = build->indices[--j];
+                build->indices[j] = swap;
+            }
+        }
+        middle = i;
+    }
+    const u32 left = build->n_nodes.fetch_add(2, SEQ_CST);
+    build->nodes[left] = {{}, first, middle - first};
+    build->nodes[left + 1] = {{}, middle, (first + count) - middle};
+    node->offset = left;
+    node->count = 0;
+    if ((depth < build->thread_depth) && (BVH_THREAD_THRESHOLD <= count)) {
+        BvhTask task = {build, left, depth + 1};
+        Thread  thread;
+        if (pthread_create(&thread, null, thread_build, &task) == 0) {
+            build_node(build, left + 1, depth + 1);
+            pthread_join(thread, null);
+            return;
+        }
+    }
+    build_node(build, left, depth + 1);
+    build_node(build, left + 1, depth + 1);
+}
+
+static void set_bvh(Bvh* bvh, const Aabb* bounds, Vec3* centroids, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+        bvh->indices[i] = i;
+    }
+    BvhBuild build;
+    build.bounds = bounds;
+    build.centroids = centroids;
+    build.nodes = bvh->nodes;
+    build.indices = bvh->indices;
+    build.n_nodes.store(1, SEQ_CST);
+    build.thread_depth = 0;
+    CpuSet set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (i32 n_threads = CPU_COUNT(&set); 1 < n_threads; n_threads >>= 1)
+        {
+            ++build.thread_depth;
+        }
+    }
+    bvh->nodes[0] = {{}, 0, n};
+    build_node(&build, 0, 0);
+    bvh->n_nodes = build.n_nodes.load(SEQ_CST);
+}
+
+// NOTE: Checks a BVH read from disk before anything walks it: every child
+// pair lies inside `nodes` past its parent, no node is reached twice and no
+// leaf sits deeper than `BVH_DEPTH`, which is what bounds the traversal
+// stacks. Leaf ranges are left to the caller.
+static bool is_valid_bvh(const BvhNode* nodes, u32 n_nodes) {
+    u32 stack[BVH_STACK];
+    u32 depths[BVH_STACK];
+    u32 n = 0;
+    u32 n_visited = 0;
+    stack[n] = 0;
+    depths[n++] = 0;
+    while (n != 0) {
+        const u32      index = stack[--n];
+        const u32      depth = depths[n];
+        const BvhNode* node = &nodes[index];
+        if (n_nodes < ++n_visited) {
+            return false;
+        }
+        if (node->count != 0) {
+            continue;
+        }
+        if ((BVH_DEPTH <= depth) || (node->offset <= index) ||
+            ((n_nodes - 1) <= node->offset))
+        {
+            return false;
+        }
+        stack[n] = node->offset;
+        depths[n++] = depth + 1;
+        stack[n] = node->offset + 1;
+        depths[n++] = depth + 1;
+    }
+    return true;
+}
+
+static INLINE f32 get_box_distance(const Aabb* box,
+                                   Vec3        origin,
+                                   Vec3        inverse_direction,
+                                   f32         t_max) {
+    const Vec3 t0 = (box->min - origin) * inverse_direction;
+    const Vec3 t1 = (box->max - origin) * inverse_direction;
+    const Vec3 near = min(t0, t1);
+    const Vec3 far = max(t0, t1);
+    const f32  t_enter = fmaxf(fmaxf(near.x, near.y), fmaxf(near.z, 0.0f));
+    const f32  t_exit = fminf(fminf(far.x, far.y), fminf(far.z, t_max));
+    return t_enter <= t_exit ? t_enter : F32_MAX;
+}
+
+#endif
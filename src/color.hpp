@@ -7,21 +7,21 @@ struct RgbColor {
     f32 blue;
 };
 
-static RgbColor& operator+=(RgbColor& a, RgbColor b) {
+static INLINE RgbColor& operator+=(RgbColor& a, RgbColor b) {
     a.red += b.red;
     a.green += b.green;
     a.blue += b.blue;
     return a;
 }
 
-static RgbColor& operator+=(RgbColor& a, f32 b) {
+static INLINE RgbColor& operator+=(RgbColor& a, f32 b) {
     a.red += b;
     a.green += b;
     a.blue += b;
     return a;
 }
 
-static RgbColor operator*(RgbColor a, RgbColor b) {
+static INLINE RgbColor operator*(RgbColor a, RgbColor b) {
     return {
         a.red * b.red,
         a.green * b.green,
@@ -29,14 +29,22 @@ static RgbColor operator*(RgbColor a, RgbColor b) {
     };
 }
 
-static RgbColor& operator*=(RgbColor& a, RgbColor b) {
+static INLINE RgbColor operator*(RgbColor a, f32 b) {
+    return {
+        a.red * b,
+        a.green * b,
+        a.blue * b,
+    };
+}
+
+static INLINE RgbColor& operator*=(RgbColor& a, RgbColor b) {
     a.red *= b.red;
     a.green *= b.green;
     a.blue *= b.blue;
     return a;
 }
 
-static RgbColor& operator/=(RgbColor& a, f32 b) {
+static INLINE RgbColor& operator/=(RgbColor& a, f32 b) {
     a.red /= b;
     a.green /= b;
     a.blue /= b;
@@ -47,7 +55,7 @@ static f32 clamp(f32 x, f32 min, f32 max) {
     return x < min ? min : max < x ? max : x;
 }
 
-static void clamp(RgbColor* color, f32 min, f32 max) {
+static INLINE void clamp(RgbColor* color, f32 min, f32 max) {
     color->red = clamp(color->red, min, max);
     color->green = clamp(color->green, min, max);
     color->blue = clamp(color->blue, min, max);
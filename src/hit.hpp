@@ -0,0 +1,128 @@
+#ifndef __HIT_H__
+#define __HIT_H__
+
+#define EPSILON 0.001f
+
+struct Ray {
+    Vec3 origin;
+    Vec3 direction;
+};
+
+// NOTE: Built once per bounce for the nearest sphere only, after the search
+// has settled on its `t` and index; the material is left behind `surface`
+// for whichever scatter reads it instead of being copied in.
+struct Hit {
+    Vec3           point;
+    Vec3           normal;
+    const Surface* surface;
+    f32            t;
+    bool           front_face;
+};
+
+static INLINE void set_hit(const Scene* scene,
+                           u32          index,
+                           const Ray*   ray,
+                           Hit*         hit,
+                           f32          t) {
+    hit->t = t;
+    const Vec3 point = ray->origin + (ray->direction * t);
+    hit->point = point;
+    const Vec3 center = {
+        scene->center_x[index],
+        scene->center_y[index],
+        scene->center_z[index],
+    };
+    const Vec3 outward_normal = (point - center) / scene->radius[index];
+    const bool front_face = dot(ray->direction, outward_normal) < 0.0f;
+    hit->front_face = front_face;
+    hit->normal = front_face ? outward_normal : -outward_normal;
+    hit->surface = &scene->surfaces[scene->surface[index]];
+}
+
+// NOTE: Tests `SIMD_WIDTH` spheres per iteration and only tracks the nearest
+// `t` and its index; lanes past `first + count` belong to the next leaf (or
+// to padding that can never be hit), so they are tested instead of masked.
+static INLINE void get_nearest(const Scene* scene,
+                               const Ray*   ray,
+                               u32          first,
+                               u32          count,
+                               f32*         t_nearest,
+                               u32*         index) {
+    const f32x8 origin_x = set1(ray->origin.x);
+    const f32x8 origin_y = set1(ray->origin.y);
+    const f32x8 origin_z = set1(ray->origin.z);
+    const f32x8 direction_x = set1(ray->direction.x);
+    const f32x8 direction_y = set1(ray->direction.y);
+    const f32x8 direction_z = set1(ray->direction.z);
+    const f32x8 a = set1(dot(ray->direction, ray->direction));
+    const f32x8 epsilon = set1(EPSILON);
+    const f32x8 zero = set1(0.0f);
+    for (u32 i = first; i < first + count; i += SIMD_WIDTH) {
+        const f32x8 offset_x = origin_x - load(&scene->center_x[i]);
+        const f32x8 offset_y = origin_y - load(&scene->center_y[i]);
+        const f32x8 offset_z = origin_z - load(&scene->center_z[i]);
+        const f32x8 half_b = (offset_x * direction_x) +
+                             (offset_y * direction_y) +
+                             (offset_z * direction_z);
+        const f32x8 c = (offset_x * offset_x) + (offset_y * offset_y) +
+                        (offset_z * offset_z) -
+                        load(&scene->radius_squared[i]);
+        const f32x8 discriminant = (half_b * half_b) - (a * c);
+        const f32x8 root = sqrt(max(discriminant, zero));
+        const f32x8 t0 = (-half_b - root) / a;
+        const f32x8 t1 = (-half_b + root) / a;
+        const f32x8 t = select(epsilon < t0, t0, t1);
+        const f32x8 mask =
+            (zero < discriminant) & (epsilon < t) & (t < set1(*t_nearest));
+        if (get_mask(mask) == 0) {
+            continue;
+        }
+        const f32x8 candidates = select(mask, t, set1(F32_MAX));
+        const f32   t_min = get_min(candidates);
+        const u32   lanes = get_mask(candidates <= set1(t_min));
+        *t_nearest = t_min;
+        *index = i + static_cast<u32>(__builtin_ctz(lanes));
+    }
+}
+
+// NOTE: Any-hit counterpart of `get_nearest` for shadow rays; it gives up on
+// the leaf as soon as a single lane blocks the ray before `t_max`.
+static INLINE bool is_blocked(const Scene* scene,
+                              const Ray*   ray,
+                              u32          first,
+                              u32          count,
+                              f32          t_max) {
+    const f32x8 origin_x = set1(ray->origin.x);
+    const f32x8 origin_y = set1(ray->origin.y);
+    const f32x8 origin_z = set1(ray->origin.z);
+    const f32x8 direction_x = set1(ray->direction.x);
+    const f32x8 direction_y = set1(ray->direction.y);
+    const f32x8 direction_z = set1(ray->direction.z);
+    const f32x8 a = set1(dot(ray->direction, ray->direction));
+    const f32x8 epsilon = set1(EPSILON);
+    const f32x8 zero = set1(0.0f);
+    for (u32 i = first; i < first + count; i += SIMD_WIDTH) {
+        const f32x8 offset_x = origin_x - load(&scene->center_x[i]);
+        const f32x8 offset_y = origin_y - load(&scene->center_y[i]);
+        const f32x8 offset_z = origin_z - load(&scene->center_z[i]);
+        const f32x8 half_b = (offset_x * direction_x) +
+                             (offset_y * direction_y) +
+                             (offset_z * direction_z);
+        const f32x8 c = (offset_x * offset_x) + (offset_y * offset_y) +
+                        (offset_z * offset_z) -
+                        load(&scene->radius_squared[i]);
+        const f32x8 discriminant = (half_b * half_b) - (a * c);
+        const f32x8 root = sqrt(max(discriminant, zero));
+        const f32x8 t0 = (-half_b - root) / a;
+        const f32x8 t1 = (-half_b + root) / a;
+        const f32x8 t = select(epsilon < t0, t0, t1);
+        if (get_mask((zero < discriminant) & (epsilon < t) &
+                     (t < set1(t_max))) != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
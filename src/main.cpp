@@ -5,67 +5,99 @@
 #include "math.hpp"
 #include "random.hpp"
 
-#include <sys/mman.h>
-#include <unistd.h>
+#include "bvh.hpp"
+#include "simd.hpp"
 
-#define MAX_THREADS 8
+#include "scene.hpp"
 
+#include "hit.hpp"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define IMAGE_WIDTH       1280
+#define IMAGE_HEIGHT      512
+#define IMAGE_MAX         16384
 #define N_BOUNCES         32
 #define SAMPLES_PER_PIXEL 32
-#define EPSILON           0.001f
 
-#define X_BLOCKS     8
-#define Y_BLOCKS     8
-#define BLOCK_WIDTH  (IMAGE_WIDTH / X_BLOCKS)
-#define BLOCK_HEIGHT (IMAGE_HEIGHT / Y_BLOCKS)
-#define N_BLOCKS     (X_BLOCKS * Y_BLOCKS)
+#define ADAPTIVE_MIN_SAMPLES 8
+#define ADAPTIVE_FLOOR       0.01f
+
+#define PREVIEW_SAMPLES 1
+#define PREVIEW_BOUNCES 4
+
+#define ROULETTE_DEPTH    12
+#define ROULETTE_SURVIVAL 0.95f
+
+#define RNG_CAMERA_DIMENSIONS 4
+#define RNG_BOUNCE_DIMENSIONS 8
+#define RNG_LIGHT_DIMENSIONS  4
+
+#define PACKET_WIDTH  4
+#define PACKET_HEIGHT 2
+
+static_assert((PACKET_WIDTH * PACKET_HEIGHT) == SIMD_WIDTH,
+              "(PACKET_WIDTH * PACKET_HEIGHT) != SIMD_WIDTH");
+
+#define WAVEFRONT_PATHS 4096
+
+#define BLOCK_WIDTH  32
+#define BLOCK_HEIGHT 16
+
+#define CACHE_LINE 64
+
+#define DENOISE_PASSES 5
+#define DENOISE_APRON  (2u << (DENOISE_PASSES - 1))
+#define DENOISE_COLOR  1.0f
+#define DENOISE_NORMAL 0.1f
+#define DENOISE_ALBEDO 0.05f
+#define DENOISE_FAR    1024.0f
+
+#ifndef COUNTERS
+    #define COUNTERS 1
+#endif
+
+// NOTE: With `COUNTERS` off the statement still has to compile, which keeps
+// the counters it names in use, but it is dead code and emits nothing.
+#if COUNTERS
+    #define COUNT(statement) statement
+#else
+    #define COUNT(statement) \
+        do {                 \
+            if (false) {     \
+                statement;   \
+            }                \
+        } while (false)
+#endif
+
+#define COUNTER_DEPTHS (N_BOUNCES + 1)
+
+#define NO_DEADLINE 0xFFFFFFFFFFFFFFFFllu
+
+#define CHECKPOINT_MAGIC    0x4B504843
+#define CHECKPOINT_VERSION  3
+#define CHECKPOINT_PATH     4096
+#define CHECKPOINT_INTERVAL 60.0f
 
-#define FLOAT_WIDTH  1280.0f
-#define FLOAT_HEIGHT 512.0f
+#define PARTIAL_MAGIC   0x54524150
+#define PARTIAL_VERSION 1
 
-static_assert(static_cast<f32>(IMAGE_WIDTH) == FLOAT_WIDTH,
-              "IMAGE_WIDTH != FLOAT_WIDTH");
-static_assert(static_cast<f32>(IMAGE_HEIGHT) == FLOAT_HEIGHT,
-              "IMAGE_HEIGHT != FLOAT_HEIGHT");
+#define FARM_JOBS 4
+
+#define KEY_LINE   256
+#define FRAME_PATH 4096
 
 #define VERTICAL_FOV 90.0f
 #define APERTURE     0.1f
-#define ASPECT_RATIO (FLOAT_WIDTH / FLOAT_HEIGHT)
-#define LENS_RADIUS  (APERTURE / 2.0f)
 
 #define LOOK_FROM ((Vec3){-0.5f, 0.75f, -0.25f})
 #define LOOK_AT   ((Vec3){0.0f, 0.0f, -1.0f})
 #define UP        ((Vec3){0.0f, 1.0f, 0.0f})
 
-enum Material {
-    LAMBERTIAN = 0,
-    METAL,
-    DIELECTRIC,
-};
-
-union Features {
-    f32 fuzz;
-    f32 refractive_index;
-};
-
-struct Hit {
-    Vec3     point;
-    Vec3     normal;
-    RgbColor albedo;
-    f32      t;
-    Features features;
-    Material material;
-    bool     front_face;
-};
-
-struct Sphere {
-    Vec3     center;
-    RgbColor albedo;
-    f32      radius;
-    Features features;
-    Material material;
-};
-
+// NOTE: `horizontal` and `vertical` span a single pixel, so a pixel
+// coordinate scales them directly; `width` keys each pixel's random stream.
 struct Camera {
     Vec3 u;
     Vec3 v;
@@ -73,11 +105,21 @@ struct Camera {
     Vec3 horizontal;
     Vec3 vertical;
     Vec3 bottom_left;
+    f32  lens_radius;
+    u32  width;
 };
 
-struct Ray {
-    Vec3 origin;
-    Vec3 direction;
+struct RayPacket {
+    f32x8 origin_x;
+    f32x8 origin_y;
+    f32x8 origin_z;
+    f32x8 direction_x;
+    f32x8 direction_y;
+    f32x8 direction_z;
+    f32x8 inverse_x;
+    f32x8 inverse_y;
+    f32x8 inverse_z;
+    f32x8 a;
 };
 
 struct Point {
@@ -90,336 +132,3326 @@ struct Block {
     Point end;
 };
 
+struct Config {
+    u32  width;
+    u32  height;
+    u32  block_width;
+    u32  block_height;
+    f32  vertical_fov;
+    f32  aperture;
+    Vec3 look_from;
+    Vec3 look_at;
+    Vec3 up;
+};
+
+// NOTE: `sample_bits` is the number of bits covering the final sample
+// count, which `SAMPLER_BLUE` needs to lay out each pixel's block. It stays
+// zero for the other samplers, so only blue noise checkpoints are tied to a
+// power-of-two sample budget when resumed.
+struct Sampling {
+    u64     seed;
+    f32     threshold;
+    u32     min_samples;
+    u32     max_samples;
+    u32     n_bounces;
+    u32     roulette_depth;
+    u32     sample_bits;
+    Sampler sampler;
+};
+
+// NOTE: One per worker, on cache lines of its own, summed once the pool is
+// idle. `n_rays`, `n_bounces` and `n_roulette` are always kept, since Mrays/s,
+// bounces per path and `./bench` are built on them; everything else is bumped
+// through `COUNT`, so a `-DCOUNTERS=0` build leaves the hot loops as they
+// were. A packet visiting a node or testing a sphere counts
+// once, like a single ray. `depths` buckets paths by how many surfaces they
+// hit before ending, with the last bucket taking anything deeper. Shadow
+// rays add to the node and sphere tests but are kept out of `n_rays`.
+struct alignas(CACHE_LINE) Counters {
+    u64 n_rays;
+    u64 n_bounces;
+    u64 n_roulette;
+    u64 n_primary;
+    u64 n_nodes;
+    u64 n_tests;
+    u64 n_absorbed;
+    u64 n_exhausted;
+    u64 n_shadows;
+    u64 n_occluded;
+    u64 n_scatters[N_MATERIALS];
+    u64 depths[COUNTER_DEPTHS];
+};
+
+struct PixelStats {
+    RgbColor sum;
+    f32      mean;
+    f32      m2;
+    u32      n;
+};
+
+// NOTE: First-hit guides for the denoiser, summed over `n` samples like
+// `PixelStats`; a miss adds the sky as its albedo and no normal at all.
+struct Aov {
+    RgbColor albedo;
+    Vec3     normal;
+    u32      n;
+};
+
+// NOTE: Planes of the denoiser, each `Frame::plane_stride` floats a row. The
+// colour is filtered back and forth between its two sets of planes.
+enum Plane {
+    PLANE_ALBEDO = 0,
+    PLANE_NORMAL = 3,
+    PLANE_COLOR = 6,
+    N_PLANES = 12,
+};
+
+struct Paths {
+    f32 origin_x[WAVEFRONT_PATHS];
+    f32 origin_y[WAVEFRONT_PATHS];
+    f32 origin_z[WAVEFRONT_PATHS];
+    f32 direction_x[WAVEFRONT_PATHS];
+    f32 direction_y[WAVEFRONT_PATHS];
+    f32 direction_z[WAVEFRONT_PATHS];
+    f32 red[WAVEFRONT_PATHS];
+    f32 green[WAVEFRONT_PATHS];
+    f32 blue[WAVEFRONT_PATHS];
+    f32 radiance_red[WAVEFRONT_PATHS];
+    f32 radiance_green[WAVEFRONT_PATHS];
+    f32 radiance_blue[WAVEFRONT_PATHS];
+    f32 pdf[WAVEFRONT_PATHS];
+    f32 t[WAVEFRONT_PATHS];
+    u32 index[WAVEFRONT_PATHS];
+    u32 pixel[WAVEFRONT_PATHS];
+    u32 depth[WAVEFRONT_PATHS];
+    Rng rng[WAVEFRONT_PATHS];
+};
+
+// NOTE: Paths stay in their slot of `paths` from camera to last bounce;
+// `live` lists the slots in use, in the order they were launched, and `free`
+// the rest, so ending a path moves one index instead of the whole path.
+struct Wavefront {
+    Paths       paths;
+    u32         live[WAVEFRONT_PATHS];
+    u32         free[WAVEFRONT_PATHS];
+    u32         queues[N_MATERIALS][WAVEFRONT_PATHS];
+    u32         n_queued[N_MATERIALS];
+    u32         n_paths;
+    u32         n_free;
+    u32         cursor;
+    PixelStats* stats;
+    u32*        launched;
+    Aov*        aovs;
+};
+
+// NOTE: A deque is a `[head, tail)` range of `blocks`, packed as
+// `(tail << 32) | head`. The owner pops from the head and thieves take the
+// back half, so each thread mostly walks a contiguous run of the Morton
+// curve.
+struct alignas(CACHE_LINE) Deque {
+    u64Atomic range;
+};
+
+typedef void (*RenderBlock)(const Camera*,
+                            const Scene*,
+                            const Sampling*,
+                            Pixel*,
+                            PixelStats*,
+                            Aov*,
+                            Block,
+                            Counters*);
+
+struct Kernel {
+    const char* name;
+    u32         n_samples;
+    u32         n_bounces;
+    u32         materials;
+    RenderBlock render_block;
+};
+
+// NOTE: Everything but `image` is sized by the job's `Config` and carved out
+// of one `Arena`. Each thread renders a block into its own `block_pixels`
+// slab of `tiles`, packed at the block's width, before copying it into the
+// mapped image; its `stats` and `launched` slabs back the wavefront renderer.
+// `bands` counts finished blocks per row of blocks and `block_times` adds up
+// the nanoseconds spent on each block. `accumulation` is either null or one
+// `PixelStats` per pixel, row-major, carried across passes. `blocks` is laid
+// out once along a Morton curve and `set_pixels` only hands out
+// `[first_block, last_block)` of it. When denoising, `aovs` sits alongside
+// `accumulation` (with `aov_tiles` as the wavefront's slabs) and `planes`
+// holds `N_PLANES` rows of `plane_stride` floats per image row, which leaves
+// `DENOISE_APRON` floats either side of every row; otherwise all three are
+// null.
+struct Frame {
+    BmpImage    image;
+    PixelStats* accumulation;
+    Aov*        aovs;
+    Pixel*      tiles;
+    Block*      blocks;
+    PixelStats* stats;
+    u32*        launched;
+    Aov*        aov_tiles;
+    f32*        planes;
+    u32Atomic*  bands;
+    u64*        block_times;
+    u32         x_blocks;
+    u32         y_blocks;
+    u32         n_blocks;
+    u32         first_block;
+    u32         last_block;
+    u32         block_pixels;
+    u32         block_height;
+    u32         plane_stride;
+};
+
+enum Work {
+    WORK_RENDER = 0,
+    WORK_TOUCH,
+    WORK_DENOISE,
+};
+
 struct Payload {
-    Pixel*        buffer;
-    const Block*  blocks;
-    const Camera* camera;
+    Frame*          frame;
+    const Camera*   camera;
+    const Scene*    scene;
+    const Sampling* sampling;
+    const Kernel*   kernel;
+    u64             deadline;
+    bool            wavefront;
+    Work            work;
 };
 
-struct Memory {
-    BmpImage image;
-    Thread   threads[MAX_THREADS];
-    Block    blocks[N_BLOCKS];
+struct Pool;
+
+struct Worker {
+    Pool*    pool;
+    u32      index;
+    u32      cpu;
+    u32      socket;
+    u64      busy;
+    u64      finish;
+    u32      n_blocks;
+    u32      n_stolen;
+    Counters counters;
+};
+
+// NOTE: Workers live for the whole process and are released once per frame
+// through `start`; `ready` separates the denoiser's passes from each other
+// and `finish` hands the frame back to the main thread.
+struct Pool {
+    Thread*        threads;
+    Worker*        workers;
+    Deque*         deques;
+    Wavefront*     wavefronts;
+    const Payload* payload;
+    u32            n_threads;
+    u32            n_sockets;
+    Barrier        start;
+    Barrier        ready;
+    Barrier        finish;
+    bool           quit;
 };
+static u64Atomic N_SAMPLES;
 
-static u16Atomic BLOCK_INDEX;
-static u16Atomic RNG_INCREMENT;
+static const Surface SURFACES[] = {
+    {{0.675f, 0.675f, 0.675f}, {}, LAMBERTIAN},
+    {{0.3f, 0.7f, 0.3f}, {}, LAMBERTIAN},
+    {{0.3f, 0.3f, 0.7f}, {}, LAMBERTIAN},
+    {{0.7f, 0.3f, 0.3f}, {}, LAMBERTIAN},
+    {{0.8f, 0.8f, 0.8f}, {0.025f}, METAL},
+    {{}, {1.5f}, DIELECTRIC},
+};
 
 static const Sphere SPHERES[] = {
-    {{0.0f, -500.5f, -1.0f}, {0.675f, 0.675f, 0.675f}, 500.0f, {}, LAMBERTIAN},
-    {{0.0f, 0.0f, -1.0f}, {0.3f, 0.7f, 0.3f}, 0.5f, {}, LAMBERTIAN},
-    {{0.0f, 0.0f, 0.35f}, {0.3f, 0.3f, 0.7f}, 0.5f, {}, LAMBERTIAN},
-    {{0.0f, 0.0f, -2.0f}, {0.7f, 0.3f, 0.3f}, 0.5f, {}, LAMBERTIAN},
-    {{1.15f, 0.0f, -0.85f}, {0.8f, 0.8f, 0.8f}, 0.5f, {0.025f}, METAL},
-    {{1.0f, 0.0f, 0.25f}, {}, 0.5f, {1.5f}, DIELECTRIC},
-    {{1.0f, 0.0f, 0.25f}, {}, -0.475f, {1.5f}, DIELECTRIC},
-    {{-1.0f, 0.0f, -0.35f}, {}, 0.5f, {1.5f}, DIELECTRIC},
-    {{-1.0f, 0.0f, -0.35f}, {}, -0.4f, {1.5f}, DIELECTRIC},
-    {{-1.25f, 0.0f, -1.75f}, {}, 0.5f, {1.5f}, DIELECTRIC},
-    {{-1.25f, 0.0f, -1.75f}, {}, -0.4f, {1.5f}, DIELECTRIC},
+    {{0.0f, -500.5f, -1.0f}, 500.0f, 0},
+    {{0.0f, 0.0f, -1.0f}, 0.5f, 1},
+    {{0.0f, 0.0f, 0.35f}, 0.5f, 2},
+    {{0.0f, 0.0f, -2.0f}, 0.5f, 3},
+    {{1.15f, 0.0f, -0.85f}, 0.5f, 4},
+    {{1.0f, 0.0f, 0.25f}, 0.5f, 5},
+    {{1.0f, 0.0f, 0.25f}, -0.475f, 5},
+    {{-1.0f, 0.0f, -0.35f}, 0.5f, 5},
+    {{-1.0f, 0.0f, -0.35f}, -0.4f, 5},
+    {{-1.25f, 0.0f, -1.75f}, 0.5f, 5},
+    {{-1.25f, 0.0f, -1.75f}, -0.4f, 5},
 };
 
-#define N_SPHERES (sizeof(SPHERES) / sizeof(SPHERES[0]))
-
-static void set_hit(const Sphere* sphere, const Ray* ray, Hit* hit, f32 t) {
-    hit->t = t;
-    const Vec3 point = ray->origin + (ray->direction * t);
-    hit->point = point;
-    const Vec3 outward_normal = (point - sphere->center) / sphere->radius;
-    const bool front_face = dot(ray->direction, outward_normal) < 0.0f;
-    hit->front_face = front_face;
-    hit->normal = front_face ? outward_normal : -outward_normal;
-    hit->material = sphere->material;
-    hit->albedo = sphere->albedo;
-    hit->features = sphere->features;
-}
-
-static bool get_hit(const Sphere* sphere,
-                    const Ray*    ray,
-                    Hit*          hit,
-                    f32           t_max) {
-    const Vec3 offset = ray->origin - sphere->center;
-    const f32  a = dot(ray->direction, ray->direction);
-    const f32  half_b = dot(offset, ray->direction);
-    const f32  c = dot(offset, offset) - (sphere->radius * sphere->radius);
-    const f32  discriminant = (half_b * half_b) - (a * c);
-    if (0.0f < discriminant) {
-        const f32 root = sqrtf(discriminant);
-        f32       t = (-half_b - root) / a;
-        if ((EPSILON < t) && (t < t_max)) {
-            set_hit(sphere, ray, hit, t);
-            return true;
+#define N_SURFACES (sizeof(SURFACES) / sizeof(SURFACES[0]))
+#define N_SPHERES  (sizeof(SPHERES) / sizeof(SPHERES[0]))
+
+static Vec3 get_inverse(Vec3 direction) {
+    return {
+        1.0f / (fabsf(direction.x) < FLT_MIN ? FLT_MIN : direction.x),
+        1.0f / (fabsf(direction.y) < FLT_MIN ? FLT_MIN : direction.y),
+        1.0f / (fabsf(direction.z) < FLT_MIN ? FLT_MIN : direction.z),
+    };
+}
+
+static f32x8 get_inverse(f32x8 direction) {
+    return set1(1.0f) /
+           select(abs(direction) < set1(FLT_MIN), set1(FLT_MIN), direction);
+}
+
+static void count_depth(Counters* counts, u32 depth) {
+    ++counts->depths[depth < COUNTER_DEPTHS ? depth : COUNTER_DEPTHS - 1];
+}
+
+static INLINE bool get_nearest_hit(const Scene* scene,
+                                   const Ray*   ray,
+                                   f32*         t,
+                                   u32*         index,
+                                   Counters*    counts) {
+    const Bvh* bvh = &scene->bvh;
+    const Vec3 inverse_direction = get_inverse(ray->direction);
+    f32        t_nearest = F32_MAX;
+    *index = scene->n_spheres;
+    BvhEntry   stack[BVH_STACK];
+    u32        n = 0;
+    stack[n++] = {0, 0.0f};
+    while (n != 0) {
+        const BvhEntry entry = stack[--n];
+        if (t_nearest <= entry.t) {
+            continue;
         }
-        t = (-half_b + root) / a;
-        if ((EPSILON < t) && (t < t_max)) {
-            set_hit(sphere, ray, hit, t);
-            return true;
+        const BvhNode* node = &bvh->nodes[entry.node];
+        COUNT(++counts->n_nodes);
+        if (node->count != 0) {
+            COUNT(counts->n_tests += node->count);
+            get_nearest(
+                scene, ray, node->offset, node->count, &t_nearest, index);
+            continue;
+        }
+        BvhEntry near = {node->offset,
+                         get_box_distance(&bvh->nodes[node->offset].box,
+                                          ray->origin,
+                                          inverse_direction,
+                                          t_nearest)};
+        BvhEntry far = {node->offset + 1,
+                        get_box_distance(&bvh->nodes[node->offset + 1].box,
+                                         ray->origin,
+                                         inverse_direction,
+                                         t_nearest)};
+        if (far.t < near.t) {
+            const BvhEntry swap = near;
+            near = far;
+            far = swap;
+        }
+        if (far.t < t_nearest) {
+            stack[n++] = far;
+        }
+        if (near.t < t_nearest) {
+            stack[n++] = near;
+        }
+    }
+    *t = t_nearest;
+    return *index != scene->n_spheres;
+}
+
+// NOTE: Shadow rays only need to know whether anything at all lies before
+// `t_max`, so children are visited in whatever order they come and the walk
+// ends at the first blocker.
+static INLINE bool is_occluded(const Scene* scene,
+                               const Ray*   ray,
+                               f32          t_max,
+                               Counters*    counts) {
+    const Bvh* bvh = &scene->bvh;
+    const Vec3 inverse_direction = get_inverse(ray->direction);
+    u32        stack[BVH_STACK];
+    u32        n = 0;
+    stack[n++] = 0;
+    while (n != 0) {
+        const BvhNode* node = &bvh->nodes[stack[--n]];
+        COUNT(++counts->n_nodes);
+        if (node->count != 0) {
+            COUNT(counts->n_tests += node->count);
+            if (is_blocked(scene, ray, node->offset, node->count, t_max)) {
+                return true;
+            }
+            continue;
+        }
+        for (u32 i = node->offset; i < node->offset + 2; ++i) {
+            if (get_box_distance(&bvh->nodes[i].box,
+                                 ray->origin,
+                                 inverse_direction,
+                                 t_max) < F32_MAX)
+            {
+                stack[n++] = i;
+            }
         }
     }
     return false;
 }
 
-static Vec3 get_random_vec3(PcgRng* rng) {
-    return {
-        get_random_f32(rng),
-        get_random_f32(rng),
-        get_random_f32(rng),
-    };
+static f32x8 get_box_distances(const Aabb*      box,
+                               const RayPacket* packet,
+                               f32x8            t_nearest) {
+    const f32x8 t0_x =
+        (set1(box->min.x) - packet->origin_x) * packet->inverse_x;
+    const f32x8 t0_y =
+        (set1(box->min.y) - packet->origin_y) * packet->inverse_y;
+    const f32x8 t0_z =
+        (set1(box->min.z) - packet->origin_z) * packet->inverse_z;
+    const f32x8 t1_x =
+        (set1(box->max.x) - packet->origin_x) * packet->inverse_x;
+    const f32x8 t1_y =
+        (set1(box->max.y) - packet->origin_y) * packet->inverse_y;
+    const f32x8 t1_z =
+        (set1(box->max.z) - packet->origin_z) * packet->inverse_z;
+    const f32x8 t_enter = max(max(min(t0_x, t1_x), min(t0_y, t1_y)),
+                              max(min(t0_z, t1_z), set1(0.0f)));
+    const f32x8 t_exit = min(min(max(t0_x, t1_x), max(t0_y, t1_y)),
+                             min(max(t0_z, t1_z), t_nearest));
+    return select((t_enter <= t_exit) & (t_enter < t_nearest),
+                  t_enter,
+                  set1(F32_MAX));
 }
 
-static Vec3 get_random_in_unit_sphere(PcgRng* rng) {
-    for (;;) {
-        const Vec3 point = (get_random_vec3(rng) * 2.0f) - 1.0f;
-        if (dot(point, point) < 1.0f) {
-            return point;
+// NOTE: Lanes start with `t_nearest` at zero when they carry no ray; every
+// test against them then fails, so partial packets need no extra masking.
+static INLINE void get_nearest_hits(const Scene*     scene,
+                                    const RayPacket* packet,
+                                    f32x8*           t_nearest,
+                                    f32x8*           index,
+                                    Counters*        counts) {
+    const Bvh*  bvh = &scene->bvh;
+    const f32x8 epsilon = set1(EPSILON);
+    const f32x8 zero = set1(0.0f);
+    BvhEntry    stack[BVH_STACK];
+    u32         n = 0;
+    stack[n++] = {0, 0.0f};
+    while (n != 0) {
+        const BvhEntry entry = stack[--n];
+        if (get_max(*t_nearest) <= entry.t) {
+            continue;
+        }
+        const BvhNode* node = &bvh->nodes[entry.node];
+        COUNT(++counts->n_nodes);
+        if (node->count != 0) {
+            COUNT(counts->n_tests += node->count);
+            for (u32 i = node->offset; i < node->offset + node->count; ++i) {
+                const f32x8 offset_x =
+                    packet->origin_x - set1(scene->center_x[i]);
+                const f32x8 offset_y =
+                    packet->origin_y - set1(scene->center_y[i]);
+                const f32x8 offset_z =
+                    packet->origin_z - set1(scene->center_z[i]);
+                const f32x8 half_b = (offset_x * packet->direction_x) +
+                                     (offset_y * packet->direction_y) +
+                                     (offset_z * packet->direction_z);
+                const f32x8 c = (offset_x * offset_x) +
+                                (offset_y * offset_y) +
+                                (offset_z * offset_z) -
+                                set1(scene->radius_squared[i]);
+                const f32x8 discriminant =
+                    (half_b * half_b) - (packet->a * c);
+                const f32x8 root = sqrt(max(discriminant, zero));
+                const f32x8 t0 = (-half_b - root) / packet->a;
+                const f32x8 t1 = (-half_b + root) / packet->a;
+                const f32x8 t = select(epsilon < t0, t0, t1);
+                const f32x8 mask = (zero < discriminant) & (epsilon < t) &
+                                   (t < *t_nearest);
+                *t_nearest = select(mask, t, *t_nearest);
+                *index = select(mask, set_bits(i), *index);
+            }
+            continue;
+        }
+        const f32x8 t_left = get_box_distances(
+            &bvh->nodes[node->offset].box, packet, *t_nearest);
+        const f32x8 t_right = get_box_distances(
+            &bvh->nodes[node->offset + 1].box, packet, *t_nearest);
+        BvhEntry near = {node->offset, get_min(t_left)};
+        BvhEntry far = {node->offset + 1, get_min(t_right)};
+        if (far.t < near.t) {
+            const BvhEntry swap = near;
+            near = far;
+            far = swap;
+        }
+        if (far.t < F32_MAX) {
+            stack[n++] = far;
+        }
+        if (near.t < F32_MAX) {
+            stack[n++] = near;
         }
     }
 }
 
-static Vec3 get_random_unit_vector(PcgRng* rng) {
-    const f32 a = get_random_f32(rng) * 2.0f * PI;
+static Vec3 get_random_unit_vector(Rng* rng) {
     const f32 z = (get_random_f32(rng) * 2.0f) - 1.0f;
     const f32 r = sqrtf(1.0f - (z * z));
+    f32       sine;
+    f32       cosine;
+    get_sin_cos((get_random_f32(rng) * 2.0f * PI) - PI, &sine, &cosine);
     return {
-        r * cosf(a),
-        r * sinf(a),
+        r * cosine,
+        r * sine,
         z,
     };
 }
 
-static RgbColor get_color(const Ray* ray, PcgRng* rng) {
-    Ray      last_ray = *ray;
-    RgbColor attenuation = {
+static Vec3 get_random_in_unit_sphere(Rng* rng) {
+    const Vec3 direction = get_random_unit_vector(rng);
+    return direction * cbrtf(get_random_f32(rng));
+}
+
+static const char* SAMPLERS[] = {
+    "random",
+    "sobol",
+    "blue",
+};
+
+#define N_SAMPLERS (sizeof(SAMPLERS) / sizeof(SAMPLERS[0]))
+
+static INLINE void set_rng(Rng*            rng,
+                           const Sampling* sampling,
+                           u32             i,
+                           u32             j,
+                           u32             width,
+                           u32             sample) {
+    switch (sampling->sampler) {
+    case SAMPLER_RANDOM: {
+        set_key(rng, sampling->seed, i + (j * width), sample);
+        break;
+    }
+    case SAMPLER_SOBOL: {
+        set_sobol(rng, sampling->seed, i + (j * width), sample);
+        break;
+    }
+    case SAMPLER_BLUE: {
+        set_blue(rng, sampling->seed, i, j, sample, sampling->sample_bits);
+        break;
+    }
+    }
+}
+
+// NOTE: Sobol dimensions are only stratified against their own pair, so
+// every bounce starts on a fixed pair (direction first, then whatever the
+// material and roulette draw) no matter how many draws came before it, and
+// a light sample takes the back half of the bounce. The plain random sampler
+// keeps counting on, as it always has.
+static INLINE void set_bounce(Rng* rng, u32 bounce) {
+    if (rng->sampler != SAMPLER_RANDOM) {
+        rng->dimension =
+            RNG_CAMERA_DIMENSIONS + (bounce * RNG_BOUNCE_DIMENSIONS);
+    }
+}
+
+static INLINE void set_light(Rng* rng, u32 bounce) {
+    if (rng->sampler != SAMPLER_RANDOM) {
+        rng->dimension = RNG_CAMERA_DIMENSIONS +
+                         (bounce * RNG_BOUNCE_DIMENSIONS) +
+                         RNG_LIGHT_DIMENSIONS;
+    }
+}
+
+static RgbColor get_sky(Vec3 direction) {
+    const f32 t = 0.5f * (unit(direction).y + 1.0f);
+    RgbColor  color = {t * 0.5f, t * 0.7f, t};
+    color += 1.0f - t;
+    return color;
+}
+
+static INLINE void scatter_lambertian(const Hit* hit,
+                                      Ray*       ray,
+                                      RgbColor*  attenuation,
+                                      Rng*       rng) {
+    *ray = {
+        hit->point,
+        hit->normal + get_random_unit_vector(rng),
+    };
+    *attenuation *= hit->surface->albedo;
+}
+
+static INLINE bool scatter_metal(const Hit* hit,
+                                 Ray*       ray,
+                                 RgbColor*  attenuation,
+                                 Rng*       rng) {
+    *ray = {
+        hit->point,
+        reflect(unit(ray->direction), hit->normal) +
+            (hit->surface->features.fuzz * get_random_in_unit_sphere(rng)),
+    };
+    if (dot(ray->direction, hit->normal) <= 0.0f) {
+        return false;
+    }
+    *attenuation *= hit->surface->albedo;
+    return true;
+}
+
+static INLINE void scatter_dielectric(const Hit* hit, Ray* ray, Rng* rng) {
+    const f32 refractive_index = hit->surface->features.refractive_index;
+    const f32 etai_over_etat =
+        hit->front_face ? 1.0f / refractive_index : refractive_index;
+    const Vec3 direction = unit(ray->direction);
+    const f32  cos_theta = fminf(dot(-direction, hit->normal), 1.0f);
+    const f32  sin_theta = sqrtf(1.0f - (cos_theta * cos_theta));
+    if ((1.0f < (etai_over_etat * sin_theta)) ||
+        (get_random_f32(rng) < schlick(cos_theta, etai_over_etat)))
+    {
+        *ray = {
+            hit->point,
+            reflect(direction, hit->normal),
+        };
+    } else {
+        *ray = {
+            hit->point,
+            refract(direction, hit->normal, etai_over_etat),
+        };
+    }
+}
+
+// NOTE: Density, over solid angle at `point`, of `sample_light` picking a
+// direction that reaches `light`; zero from inside it, where no light is
+// ever sampled. `1 - cos` is rearranged so that far, small lights do not
+// cancel down to nothing.
+static INLINE f32 get_light_pdf(const Scene* scene, u32 light, Vec3 point) {
+    const Vec3 offset = {
+        scene->center_x[light] - point.x,
+        scene->center_y[light] - point.y,
+        scene->center_z[light] - point.z,
+    };
+    const f32 distance_squared = dot(offset, offset);
+    if (distance_squared <= scene->radius_squared[light]) {
+        return 0.0f;
+    }
+    const f32 sin_squared = scene->radius_squared[light] / distance_squared;
+    const f32 cone = sin_squared / (1.0f + sqrtf(1.0f - sin_squared));
+    return 1.0f / (2.0f * PI * cone * static_cast<f32>(scene->n_lights));
+}
+
+// NOTE: Picks one emissive sphere uniformly and then a direction uniformly
+// within the cone it subtends from `point`, so every sample can see the
+// light; `t` is where that direction first meets its surface.
+static INLINE bool sample_light(const Scene* scene,
+                                Vec3         point,
+                                Ray*         ray,
+                                f32*         t,
+                                f32*         pdf,
+                                u32*         light,
+                                Rng*         rng) {
+    const u32 n = scene->n_lights;
+    const u32 pick = static_cast<u32>(get_random_f32(rng) *
+                                      static_cast<f32>(n));
+    *light = scene->lights[pick < n ? pick : n - 1];
+    const f32 u = get_random_f32(rng);
+    f32       sine;
+    f32       cosine;
+    get_sin_cos((get_random_f32(rng) * 2.0f * PI) - PI, &sine, &cosine);
+    const Vec3 offset = {
+        scene->center_x[*light] - point.x,
+        scene->center_y[*light] - point.y,
+        scene->center_z[*light] - point.z,
+    };
+    const f32 distance_squared = dot(offset, offset);
+    const f32 radius_squared = scene->radius_squared[*light];
+    if (distance_squared <= radius_squared) {
+        return false;
+    }
+    const f32  distance = sqrtf(distance_squared);
+    const f32  sin_squared = radius_squared / distance_squared;
+    const f32  cone = sin_squared / (1.0f + sqrtf(1.0f - sin_squared));
+    const f32  cos_theta = 1.0f - (u * cone);
+    const f32  sin_theta = sqrtf(fmaxf(1.0f - (cos_theta * cos_theta), 0.0f));
+    const Vec3 w = offset / distance;
+    const Vec3 u_axis = unit(cross(
+        0.9f < fabsf(w.x) ? Vec3{0.0f, 1.0f, 0.0f} : Vec3{1.0f, 0.0f, 0.0f},
+        w));
+    const Vec3 v_axis = cross(w, u_axis);
+    *ray = {
+        point,
+        (u_axis * (sin_theta * cosine)) + (v_axis * (sin_theta * sine)) +
+            (w * cos_theta),
+    };
+    *t = (distance * cos_theta) -
+         sqrtf(fmaxf(radius_squared - (distance_squared * sin_theta *
+                                       sin_theta),
+                     0.0f));
+    *pdf = 1.0f / (2.0f * PI * cone * static_cast<f32>(n));
+    return true;
+}
+
+// NOTE: Power heuristic weight of a sample drawn with density `a` against
+// one that could have come from a strategy with density `b`.
+static INLINE f32 get_weight(f32 a, f32 b) {
+    return (a * a) / ((a * a) + (b * b));
+}
+
+// NOTE: Next-event estimation off a lambertian hit, taken after it has
+// scattered: `attenuation` already carries the albedo, so what is returned
+// still has to be scaled by it. The shadow ray is weighted against the odds
+// of the cosine-weighted bounce landing on the same light.
+static INLINE RgbColor get_direct(const Scene* scene,
+                                  const Hit*   hit,
+                                  u32          bounce,
+                                  Counters*    counts,
+                                  Rng*         rng) {
+    if (scene->n_lights == 0) {
+        return {};
+    }
+    set_light(rng, bounce);
+    Ray ray;
+    f32 t;
+    f32 pdf;
+    u32 light;
+    if (!sample_light(scene, hit->point, &ray, &t, &pdf, &light, rng)) {
+        return {};
+    }
+    const f32 cosine = dot(hit->normal, ray.direction);
+    if (cosine <= 0.0f) {
+        return {};
+    }
+    COUNT(++counts->n_shadows);
+    if (is_occluded(scene, &ray, t - EPSILON, counts)) {
+        COUNT(++counts->n_occluded);
+        return {};
+    }
+    return scene->surfaces[scene->surface[light]].albedo *
+           ((cosine * get_weight(pdf, cosine / PI)) / (PI * pdf));
+}
+
+// NOTE: Density of the cosine-weighted bounce `scatter_lambertian` took.
+static INLINE f32 get_lambertian_pdf(const Hit* hit, Vec3 direction) {
+    return fmaxf(dot(hit->normal, unit(direction)), 0.0f) / PI;
+}
+
+// NOTE: `pdf` is the density of the bounce that led to the emitter, or zero
+// when that was the camera or a specular bounce that light sampling could
+// never have matched.
+static INLINE f32 get_emitted_weight(const Scene* scene,
+                                     const Ray*   ray,
+                                     u32          index,
+                                     f32          pdf) {
+    if (pdf <= 0.0f) {
+        return 1.0f;
+    }
+    return get_weight(pdf, get_light_pdf(scene, index, ray->origin));
+}
+
+// NOTE: Past `roulette_depth` a path survives with probability equal to its
+// largest attenuation channel (capped so that undimmed paths, e.g. through
+// glass, still end) and is reweighted to stay unbiased.
+static INLINE bool get_roulette(const Sampling* sampling,
+                                u32             depth,
+                                RgbColor*       attenuation,
+                                Rng*            rng) {
+    if (depth < sampling->roulette_depth) {
+        return false;
+    }
+    const f32 survival = fminf(
+        fmaxf(fmaxf(attenuation->red, attenuation->green), attenuation->blue),
+        ROULETTE_SURVIVAL);
+    if (survival <= get_random_f32(rng)) {
+        return true;
+    }
+    *attenuation /= survival;
+    return false;
+}
+
+// NOTE: `t` and `index` must already describe the nearest hit of `ray`; the
+// caller decides how that first intersection is found. A non-zero `BOUNCES`
+// replaces `sampling->n_bounces`, and `MATERIALS` must cover every material
+// in the scene. Only kernels that may meet an emitter sample lights, and
+// light found either way is weighted by multiple importance sampling.
+// Emitters end the path on their material alone, so only a surface that
+// scatters has its `Hit` built.
+template <u32 BOUNCES, u32 MATERIALS>
+static RgbColor get_color(const Scene*    scene,
+                          const Sampling* sampling,
+                          const Ray*      ray,
+                          f32             t,
+                          u32             index,
+                          Counters*       counts,
+                          Rng*            rng) {
+    const u32 n_bounces = BOUNCES != 0 ? BOUNCES : sampling->n_bounces;
+    Ray       last_ray = *ray;
+    RgbColor  attenuation = {
         1.0f,
         1.0f,
         1.0f,
     };
-    for (u8 _ = 0; _ < N_BOUNCES; ++_) {
-        Hit  last_hit = {};
-        Hit  nearest_hit = {};
-        bool hit_anything = false;
-        f32  t_nearest = F32_MAX;
-        for (u8 i = 0; i < N_SPHERES; ++i) {
-            if (get_hit(&SPHERES[i], &last_ray, &last_hit, t_nearest)) {
-                hit_anything = true;
-                t_nearest = last_hit.t;
-                nearest_hit = last_hit;
+    RgbColor radiance = {};
+    f32      pdf = 0.0f;
+    for (u32 i = 0; i < n_bounces; ++i) {
+        if (i != 0) {
+            ++counts->n_rays;
+            if (!get_nearest_hit(scene, &last_ray, &t, &index, counts)) {
+                COUNT(count_depth(counts, i));
+                radiance += attenuation * get_sky(last_ray.direction);
+                return radiance;
             }
         }
-        if (hit_anything) {
-            switch (nearest_hit.material) {
-            case LAMBERTIAN: {
-                last_ray = {
-                    nearest_hit.point,
-                    nearest_hit.normal + get_random_unit_vector(rng),
-                };
-                attenuation *= nearest_hit.albedo;
-                break;
-            }
-            case METAL: {
-                last_ray = {
-                    nearest_hit.point,
-                    reflect(unit(last_ray.direction), nearest_hit.normal) +
-                        (nearest_hit.features.fuzz *
-                         get_random_in_unit_sphere(rng)),
-                };
-                if (dot(last_ray.direction, nearest_hit.normal) <= 0.0f) {
-                    return {};
-                }
-                attenuation *= nearest_hit.albedo;
-                break;
-            }
-            case DIELECTRIC: {
-                const f32 etai_over_etat =
-                    nearest_hit.front_face
-                        ? 1.0f / nearest_hit.features.refractive_index
-                        : nearest_hit.features.refractive_index;
-                const Vec3 direction = unit(last_ray.direction);
-                const f32  cos_theta =
-                    fminf(dot(-direction, nearest_hit.normal), 1.0f);
-                const f32 sin_theta = sqrtf(1.0f - (cos_theta * cos_theta));
-                if ((1.0f < (etai_over_etat * sin_theta)) ||
-                    (get_random_f32(rng) < schlick(cos_theta, etai_over_etat)))
-                {
-                    last_ray = {
-                        nearest_hit.point,
-                        reflect(direction, nearest_hit.normal),
-                    };
-                } else {
-                    last_ray = {
-                        nearest_hit.point,
-                        refract(direction, nearest_hit.normal, etai_over_etat),
-                    };
-                }
-                break;
+        ++counts->n_bounces;
+        const Surface* surface = &scene->surfaces[scene->surface[index]];
+        if (!(MATERIALS & MATERIAL_BIT(surface->material))) {
+            __builtin_unreachable();
+        }
+        COUNT(++counts->n_scatters[surface->material]);
+        if ((MATERIALS & MATERIAL_BIT(EMISSIVE)) &&
+            (surface->material == EMISSIVE))
+        {
+            radiance += attenuation * surface->albedo *
+                        get_emitted_weight(scene, &last_ray, index, pdf);
+            COUNT(count_depth(counts, i + 1));
+            return radiance;
+        }
+        Hit nearest_hit;
+        set_hit(scene, index, &last_ray, &nearest_hit, t);
+        set_bounce(rng, i);
+        switch (surface->material) {
+        case LAMBERTIAN: {
+            scatter_lambertian(&nearest_hit, &last_ray, &attenuation, rng);
+            if (MATERIALS & MATERIAL_BIT(EMISSIVE)) {
+                radiance += attenuation *
+                            get_direct(scene, &nearest_hit, i, counts, rng);
+                pdf = get_lambertian_pdf(&nearest_hit, last_ray.direction);
             }
+            break;
+        }
+        case METAL: {
+            if (!scatter_metal(&nearest_hit, &last_ray, &attenuation, rng)) {
+                COUNT(++counts->n_absorbed);
+                COUNT(count_depth(counts, i + 1));
+                return radiance;
             }
-        } else {
-            const f32 t = 0.5f * (unit(last_ray.direction).y + 1.0f);
-            RgbColor  color = {t * 0.5f, t * 0.7f, t};
-            color += 1.0f - t;
-            return attenuation * color;
+            pdf = 0.0f;
+            break;
+        }
+        case DIELECTRIC: {
+            scatter_dielectric(&nearest_hit, &last_ray, rng);
+            pdf = 0.0f;
+            break;
+        }
+        case EMISSIVE: {
+            __builtin_unreachable();
+        }
+        }
+        if (get_roulette(sampling, i + 1u, &attenuation, rng)) {
+            ++counts->n_roulette;
+            COUNT(count_depth(counts, i + 1));
+            return radiance;
         }
     }
-    return attenuation;
+    COUNT(++counts->n_exhausted);
+    COUNT(count_depth(counts, n_bounces));
+    radiance += attenuation;
+    return radiance;
 }
 
-static Vec3 random_in_unit_disk(PcgRng* rng) {
-    for (;;) {
-        const Vec3 point = {
-            (get_random_f32(rng) * 2.0f) - 1.0f,
-            (get_random_f32(rng) * 2.0f) - 1.0f,
-            0.0f,
-        };
-        if (dot(point, point) < 1.0f) {
-            return point;
-        }
-    }
+static Vec3 random_in_unit_disk(Rng* rng) {
+    const f32 r = sqrtf(get_random_f32(rng));
+    f32       sine;
+    f32       cosine;
+    get_sin_cos((get_random_f32(rng) * 2.0f * PI) - PI, &sine, &cosine);
+    return {
+        r * cosine,
+        r * sine,
+        0.0f,
+    };
 }
 
 #define RGB_COLOR_SCALE 255.0f
 
-static void render_block(const Camera* camera,
-                         Pixel*        pixels,
-                         Block         block,
-                         PcgRng*       rng) {
-    for (u32 j = block.start.y; j < block.end.y; ++j) {
-        const u32 j_offset = j * IMAGE_WIDTH;
-        for (u32 i = block.start.x; i < block.end.x; ++i) {
-            RgbColor color = {};
-            for (u8 _ = 0; _ < SAMPLES_PER_PIXEL; ++_) {
-                const f32 x =
-                    (static_cast<f32>(i) + get_random_f32(rng)) / FLOAT_WIDTH;
-                const f32 y =
-                    (static_cast<f32>(j) + get_random_f32(rng)) / FLOAT_HEIGHT;
-                const Vec3 lens_point = LENS_RADIUS * random_in_unit_disk(rng);
-                const Vec3 lens_offset =
-                    (camera->u * lens_point.x) + (camera->v * lens_point.y);
-                const Ray ray = {
-                    camera->origin + lens_offset,
-                    (camera->bottom_left + (x * camera->horizontal) +
-                     (y * camera->vertical)) -
-                        camera->origin - lens_offset,
-                };
-                color += get_color(&ray, rng);
+static INLINE Ray get_camera_ray(const Camera* camera,
+                                 u32           i,
+                                 u32           j,
+                                 Rng*          rng) {
+    const f32  x = static_cast<f32>(i) + get_random_f32(rng);
+    const f32  y = static_cast<f32>(j) + get_random_f32(rng);
+    const Vec3 lens_point = camera->lens_radius * random_in_unit_disk(rng);
+    const Vec3 lens_offset =
+        (camera->u * lens_point.x) + (camera->v * lens_point.y);
+    return {
+        camera->origin + lens_offset,
+        (camera->bottom_left + (x * camera->horizontal) +
+         (y * camera->vertical)) -
+            camera->origin - lens_offset,
+    };
+}
+
+// NOTE: Same draws, in the same order, as `get_camera_ray` for each lane.
+static INLINE void set_camera_rays(const Camera* camera,
+                                   Point         start,
+                                   Rng*          rngs,
+                                   RayPacket*    packet) {
+    f32 offset_x[SIMD_WIDTH];
+    f32 offset_y[SIMD_WIDTH];
+    for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+        offset_x[k] = static_cast<f32>(start.x + (k % PACKET_WIDTH));
+        offset_y[k] = static_cast<f32>(start.y + (k / PACKET_WIDTH));
+    }
+    const f32x8 x = load(offset_x) + get_random_f32x8(rngs);
+    const f32x8 y = load(offset_y) + get_random_f32x8(rngs);
+    const f32x8 r = sqrt(get_random_f32x8(rngs));
+    f32x8       sine;
+    f32x8       cosine;
+    get_sin_cos((get_random_f32x8(rngs) * set1(2.0f * PI)) - set1(PI),
+                &sine,
+                &cosine);
+    const f32x8 lens_x = set1(camera->lens_radius) * r * cosine;
+    const f32x8 lens_y = set1(camera->lens_radius) * r * sine;
+    const f32x8 lens_offset_x =
+        (set1(camera->u.x) * lens_x) + (set1(camera->v.x) * lens_y);
+    const f32x8 lens_offset_y =
+        (set1(camera->u.y) * lens_x) + (set1(camera->v.y) * lens_y);
+    const f32x8 lens_offset_z =
+        (set1(camera->u.z) * lens_x) + (set1(camera->v.z) * lens_y);
+    packet->origin_x = set1(camera->origin.x) + lens_offset_x;
+    packet->origin_y = set1(camera->origin.y) + lens_offset_y;
+    packet->origin_z = set1(camera->origin.z) + lens_offset_z;
+    packet->direction_x =
+        (set1(camera->bottom_left.x) + (x * set1(camera->horizontal.x)) +
+         (y * set1(camera->vertical.x))) -
+        packet->origin_x;
+    packet->direction_y =
+        (set1(camera->bottom_left.y) + (x * set1(camera->horizontal.y)) +
+         (y * set1(camera->vertical.y))) -
+        packet->origin_y;
+    packet->direction_z =
+        (set1(camera->bottom_left.z) + (x * set1(camera->horizontal.z)) +
+         (y * set1(camera->vertical.z))) -
+        packet->origin_z;
+}
+
+// NOTE: With a fixed `SAMPLES` nothing reads the running luminance
+// statistics, so only the sum and count are kept.
+template <u32 SAMPLES = 0>
+static void add_sample(PixelStats* stats, RgbColor color) {
+    stats->sum += color;
+    if (SAMPLES != 0) {
+        ++stats->n;
+        return;
+    }
+    const f32 luminance = (0.2126f * color.red) + (0.7152f * color.green) +
+                          (0.0722f * color.blue);
+    const f32 delta = luminance - stats->mean;
+    ++stats->n;
+    stats->mean += delta / static_cast<f32>(stats->n);
+    stats->m2 += delta * (luminance - stats->mean);
+}
+
+// NOTE: Costs one `set_hit` per primary hit and no extra rays; `index` is
+// `scene->n_spheres` for a miss.
+static void add_aov(Aov*         aov,
+                    const Scene* scene,
+                    const Ray*   ray,
+                    f32          t,
+                    u32          index) {
+    ++aov->n;
+    if (index == scene->n_spheres) {
+        aov->albedo += get_sky(ray->direction);
+        return;
+    }
+    Hit hit;
+    set_hit(scene, index, ray, &hit, t);
+    aov->albedo += hit.surface->albedo;
+    aov->normal = aov->normal + hit.normal;
+}
+
+// NOTE: A pixel is done once the standard error of its mean luminance,
+// carried through the `sqrtf` gamma of `set_pixel`, falls under `threshold`;
+// the mean is floored so that near-black pixels do not blow up that slope.
+// A non-zero `SAMPLES` stands for a fixed, non-adaptive sample count.
+template <u32 SAMPLES = 0>
+static bool is_converged(const PixelStats* stats, const Sampling* sampling) {
+    if (SAMPLES != 0) {
+        return SAMPLES <= stats->n;
+    }
+    if (stats->n < sampling->min_samples) {
+        return false;
+    }
+    if (sampling->max_samples <= stats->n) {
+        return true;
+    }
+    const f32 n = static_cast<f32>(stats->n);
+    const f32 error = sqrtf(stats->m2 / ((n - 1.0f) * n));
+    const f32 slope = 2.0f * sqrtf(fmaxf(stats->mean, ADAPTIVE_FLOOR));
+    return error <= (sampling->threshold * slope);
+}
+
+// NOTE: Primary rays of a `PACKET_WIDTH` x `PACKET_HEIGHT` group of pixels
+// are traced together for each sample; every ray then continues on its own
+// through `get_color` from its first hit. Lanes drop out of the packet as
+// their pixels converge. `aovs` is either null or one `Aov` per lane.
+template <u32 SAMPLES, u32 BOUNCES, u32 MATERIALS>
+static void render_packet(const Camera*   camera,
+                          const Scene*    scene,
+                          const Sampling* sampling,
+                          Point           start,
+                          Point           end,
+                          PixelStats*     stats,
+                          Aov*            aovs,
+                          Counters*       counts) {
+    Rng rngs[SIMD_WIDTH] = {};
+    Ray rays[SIMD_WIDTH];
+    f32 origin_x[SIMD_WIDTH];
+    f32 origin_y[SIMD_WIDTH];
+    f32 origin_z[SIMD_WIDTH];
+    f32 direction_x[SIMD_WIDTH];
+    f32 direction_y[SIMD_WIDTH];
+    f32 direction_z[SIMD_WIDTH];
+    f32 t_active[SIMD_WIDTH];
+    f32 t_nearest[SIMD_WIDTH];
+    u32 index[SIMD_WIDTH];
+    for (;;) {
+        bool active = false;
+        for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+            const u32 i = start.x + (k % PACKET_WIDTH);
+            const u32 j = start.y + (k / PACKET_WIDTH);
+            if ((end.x <= i) || (end.y <= j) ||
+                is_converged<SAMPLES>(&stats[k], sampling))
+            {
+                t_active[k] = 0.0f;
+            } else {
+                active = true;
+                ++counts->n_rays;
+                COUNT(++counts->n_primary);
+                set_rng(&rngs[k], sampling, i, j, camera->width, stats[k].n);
+                t_active[k] = F32_MAX;
             }
-            color /= static_cast<f32>(SAMPLES_PER_PIXEL);
-            clamp(&color, 0.0f, 1.0f);
-            pixels[i + j_offset] = {
-                static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.blue)),
-                static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.green)),
-                static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.red)),
+        }
+        if (!active) {
+            return;
+        }
+        RayPacket packet;
+        set_camera_rays(camera, start, rngs, &packet);
+        const f32x8 mask = set1(0.0f) < load(t_active);
+        packet.origin_x = select(mask, packet.origin_x, set1(0.0f));
+        packet.origin_y = select(mask, packet.origin_y, set1(0.0f));
+        packet.origin_z = select(mask, packet.origin_z, set1(0.0f));
+        packet.direction_x = select(mask, packet.direction_x, set1(1.0f));
+        packet.direction_y = select(mask, packet.direction_y, set1(1.0f));
+        packet.direction_z = select(mask, packet.direction_z, set1(1.0f));
+        packet.inverse_x = get_inverse(packet.direction_x);
+        packet.inverse_y = get_inverse(packet.direction_y);
+        packet.inverse_z = get_inverse(packet.direction_z);
+        store(origin_x, packet.origin_x);
+        store(origin_y, packet.origin_y);
+        store(origin_z, packet.origin_z);
+        store(direction_x, packet.direction_x);
+        store(direction_y, packet.direction_y);
+        store(direction_z, packet.direction_z);
+        for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+            rays[k] = {
+                {origin_x[k], origin_y[k], origin_z[k]},
+                {direction_x[k], direction_y[k], direction_z[k]},
             };
         }
+        packet.a = (packet.direction_x * packet.direction_x) +
+                   (packet.direction_y * packet.direction_y) +
+                   (packet.direction_z * packet.direction_z);
+        f32x8 t = load(t_active);
+        f32x8 nearest = set_bits(scene->n_spheres);
+        get_nearest_hits(scene, &packet, &t, &nearest, counts);
+        store(t_nearest, t);
+        store_bits(index, nearest);
+        for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+            if (t_active[k] == 0.0f) {
+                continue;
+            }
+            if (aovs) {
+                add_aov(&aovs[k], scene, &rays[k], t_nearest[k], index[k]);
+            }
+            if (index[k] == scene->n_spheres) {
+                COUNT(count_depth(counts, 0));
+                add_sample<SAMPLES>(&stats[k], get_sky(rays[k].direction));
+                continue;
+            }
+            add_sample<SAMPLES>(
+                &stats[k],
+                get_color<BOUNCES, MATERIALS>(scene,
+                                              sampling,
+                                              &rays[k],
+                                              t_nearest[k],
+                                              index[k],
+                                              counts,
+                                              &rngs[k]));
+        }
     }
 }
 
-static u64 get_microseconds() {
-    TimeValue time;
-    gettimeofday(&time, null);
-    return static_cast<u64>(time.tv_usec);
+static void set_pixel(Pixel* pixel, RgbColor color) {
+    clamp(&color, 0.0f, 1.0f);
+    *pixel = {
+        static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.blue)),
+        static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.green)),
+        static_cast<u8>(RGB_COLOR_SCALE * sqrtf(color.red)),
+    };
 }
 
-static void* thread_render(void* payload) {
-    Pixel*        buffer = reinterpret_cast<Payload*>(payload)->buffer;
-    const Block*  blocks = reinterpret_cast<Payload*>(payload)->blocks;
-    const Camera* camera = reinterpret_cast<Payload*>(payload)->camera;
-    PcgRng        rng = {};
-    set_seed(&rng, get_microseconds(), RNG_INCREMENT.fetch_add(1, SEQ_CST));
-    for (;;) {
-        const u16 index = BLOCK_INDEX.fetch_add(1, SEQ_CST);
-        if (N_BLOCKS <= index) {
-            return null;
+static void set_pixel(Pixel* pixel, const PixelStats* stats) {
+    RgbColor color = stats->sum;
+    color /= static_cast<f32>(stats->n);
+    set_pixel(pixel, color);
+}
+
+// NOTE: With an `accumulation` buffer each pixel picks up from the samples it
+// already has; its random streams are keyed by sample index, so a render
+// split into passes matches one made in a single go. `aovs`, when there is
+// one, is laid out and carried over the same way.
+template <u32 SAMPLES, u32 BOUNCES, u32 MATERIALS>
+static void render_block(const Camera*   camera,
+                         const Scene*    scene,
+                         const Sampling* sampling,
+                         Pixel*          pixels,
+                         PixelStats*     accumulation,
+                         Aov*            aovs,
+                         Block           block,
+                         Counters*       counts) {
+    const u32 width = block.end.x - block.start.x;
+    u64       n_samples = 0;
+    for (u32 y = block.start.y; y < block.end.y; y += PACKET_HEIGHT) {
+        for (u32 x = block.start.x; x < block.end.x; x += PACKET_WIDTH) {
+            PixelStats stats[SIMD_WIDTH] = {};
+            Aov        lanes[SIMD_WIDTH] = {};
+            if (accumulation) {
+                for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+                    const u32 i = x + (k % PACKET_WIDTH);
+                    const u32 j = y + (k / PACKET_WIDTH);
+                    if ((i < block.end.x) && (j < block.end.y)) {
+                        stats[k] = accumulation[i + (j * camera->width)];
+                        if (aovs) {
+                            lanes[k] = aovs[i + (j * camera->width)];
+                        }
+                    }
+                }
+            }
+            render_packet<SAMPLES, BOUNCES, MATERIALS>(camera,
+                                                       scene,
+                                                       sampling,
+                                                       {x, y},
+                                                       block.end,
+                                                       stats,
+                                                       aovs ? lanes : null,
+                                                       counts);
+            for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+                const u32 i = x + (k % PACKET_WIDTH);
+                const u32 j = y + (k / PACKET_WIDTH);
+                if ((block.end.x <= i) || (block.end.y <= j)) {
+                    continue;
+                }
+                set_pixel(&pixels[(i - block.start.x) +
+                                  ((j - block.start.y) * width)],
+                          &stats[k]);
+                n_samples += stats[k].n;
+                if (accumulation) {
+                    PixelStats* accumulated =
+                        &accumulation[i + (j * camera->width)];
+                    n_samples -= accumulated->n;
+                    *accumulated = stats[k];
+                }
+                if (aovs) {
+                    aovs[i + (j * camera->width)] = lanes[k];
+                }
+            }
         }
-        render_block(camera, buffer, blocks[index], &rng);
     }
+    N_SAMPLES.fetch_add(n_samples, SEQ_CST);
 }
 
-static void set_pixels(Memory* memory) {
-    const f32    theta = degrees_to_radians(VERTICAL_FOV);
-    const f32    h = tanf(theta / 2.0f);
-    const f32    viewport_height = 2.0f * h;
-    const f32    viewport_width = ASPECT_RATIO * viewport_height;
-    const Vec3   w = unit(LOOK_FROM - LOOK_AT);
-    const Vec3   u = unit(cross(UP, w));
-    const Vec3   v = cross(w, u);
-    const Vec3   origin = LOOK_FROM;
-    const f32    focus_distance = len(LOOK_FROM - LOOK_AT);
-    const Vec3   horizontal = focus_distance * viewport_width * u;
-    const Vec3   vertical = focus_distance * viewport_height * v;
-    const Camera camera = {
-        u,
-        v,
-        origin,
-        horizontal,
-        vertical,
-        origin - (horizontal / 2.0f) - (vertical / 2.0f) -
-            (focus_distance * w),
+#define KERNEL(name, samples, bounces, materials)                  \
+    {                                                              \
+        name, samples, bounces, materials,                         \
+            render_block<samples, bounces, materials>,             \
+    }
+
+#define KERNELS(name, samples, bounces)                            \
+    KERNEL(name, samples, bounces, MATERIAL_BIT(LAMBERTIAN)),      \
+        KERNEL(name,                                               \
+               samples,                                            \
+               bounces,                                            \
+               MATERIAL_BIT(LAMBERTIAN) | MATERIAL_BIT(METAL)),    \
+        KERNEL(name,                                               \
+               samples,                                            \
+               bounces,                                            \
+               MATERIAL_BIT(LAMBERTIAN) | MATERIAL_BIT(METAL) |    \
+                   MATERIAL_BIT(DIELECTRIC)),                      \
+        KERNEL(name, samples, bounces, ALL_MATERIALS)
+
+// NOTE: Ordered from most to least specialized; the last entry takes any
+// configuration, so `get_kernel` always finds one. A `resumable` render gets
+// the luminance statistics even at a fixed sample count, since a later run may
+// pick its checkpoint up with `--adaptive`.
+static const Kernel KERNELS[] = {
+    KERNELS("preview", PREVIEW_SAMPLES, PREVIEW_BOUNCES),
+    KERNELS("final", SAMPLES_PER_PIXEL, N_BOUNCES),
+    KERNELS("generic", 0, 0),
+};
+
+#define N_KERNELS (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+static const Kernel* get_kernel(const Sampling* sampling,
+                                u32             materials,
+                                bool            resumable) {
+    const bool fixed = !resumable && (sampling->threshold <= 0.0f) &&
+                       (sampling->min_samples == sampling->max_samples);
+    for (u32 i = 0; i < N_KERNELS; ++i) {
+        const Kernel* kernel = &KERNELS[i];
+        if (((kernel->n_samples == 0) ||
+             (fixed && (kernel->n_samples == sampling->max_samples))) &&
+            ((kernel->n_bounces == 0) ||
+             (kernel->n_bounces == sampling->n_bounces)) &&
+            ((kernel->materials & materials) == materials))
+        {
+            return kernel;
+        }
+    }
+    exit(EXIT_FAILURE);
+}
+
+static Ray get_ray(const Paths* paths, u32 k) {
+    return {
+        {paths->origin_x[k], paths->origin_y[k], paths->origin_z[k]},
+        {paths->direction_x[k], paths->direction_y[k], paths->direction_z[k]},
     };
-    Payload payload = {
-        memory->image.pixels,
-        memory->blocks,
-        &camera,
+}
+
+static void set_ray(Paths* paths, u32 k, const Ray* ray) {
+    paths->origin_x[k] = ray->origin.x;
+    paths->origin_y[k] = ray->origin.y;
+    paths->origin_z[k] = ray->origin.z;
+    paths->direction_x[k] = ray->direction.x;
+    paths->direction_y[k] = ray->direction.y;
+    paths->direction_z[k] = ray->direction.z;
+}
+
+static RgbColor get_attenuation(const Paths* paths, u32 k) {
+    return {paths->red[k], paths->green[k], paths->blue[k]};
+}
+
+static void set_attenuation(Paths* paths, u32 k, RgbColor attenuation) {
+    paths->red[k] = attenuation.red;
+    paths->green[k] = attenuation.green;
+    paths->blue[k] = attenuation.blue;
+}
+
+static RgbColor get_radiance(const Paths* paths, u32 k) {
+    return {
+        paths->radiance_red[k],
+        paths->radiance_green[k],
+        paths->radiance_blue[k],
     };
-    u16 index = 0;
-    for (u32 y = 0; y < Y_BLOCKS; ++y) {
-        for (u32 x = 0; x < X_BLOCKS; ++x) {
-            const Point start = {
-                x * BLOCK_WIDTH,
-                y * BLOCK_HEIGHT,
-            };
-            Point end = {
-                start.x + BLOCK_WIDTH,
-                start.y + BLOCK_HEIGHT,
-            };
-            end.x = end.x < IMAGE_WIDTH ? end.x : IMAGE_WIDTH;
-            end.y = end.y < IMAGE_HEIGHT ? end.y : IMAGE_HEIGHT;
-            const Block block = {
-                start,
-                end,
-            };
-            memory->blocks[index++] = block;
+}
+
+static void set_radiance(Paths* paths, u32 k, RgbColor radiance) {
+    paths->radiance_red[k] = radiance.red;
+    paths->radiance_green[k] = radiance.green;
+    paths->radiance_blue[k] = radiance.blue;
+}
+
+// NOTE: Pixels are visited round-robin, one sample each; past
+// `min_samples` a pixel only gets another sample once all of its launched
+// samples have finished and it still has not converged.
+static void generate_paths(const Camera*   camera,
+                           const Sampling* sampling,
+                           Block           block,
+                           Wavefront*      wavefront,
+                           Counters*       counts) {
+    Paths*    paths = &wavefront->paths;
+    const u32 width = block.end.x - block.start.x;
+    const u32 n_pixels = width * (block.end.y - block.start.y);
+    for (u32 idle = 0;
+         (wavefront->n_paths < WAVEFRONT_PATHS) && (idle < n_pixels);)
+    {
+        const u32 pixel = wavefront->cursor;
+        wavefront->cursor = (pixel + 1) % n_pixels;
+        const PixelStats* stats = &wavefront->stats[pixel];
+        const u32         launched = wavefront->launched[pixel];
+        if ((sampling->min_samples <= launched) &&
+            ((launched != stats->n) || is_converged(stats, sampling)))
+        {
+            ++idle;
+            continue;
         }
+        idle = 0;
+        const u32 k = wavefront->free[--wavefront->n_free];
+        wavefront->live[wavefront->n_paths++] = k;
+        const u32 i = block.start.x + (pixel % width);
+        const u32 j = block.start.y + (pixel / width);
+        set_rng(&paths->rng[k],
+                sampling,
+                i,
+                j,
+                camera->width,
+                wavefront->launched[pixel]++);
+        COUNT(++counts->n_primary);
+        const Ray ray = get_camera_ray(camera, i, j, &paths->rng[k]);
+        set_ray(paths, k, &ray);
+        set_attenuation(paths, k, {1.0f, 1.0f, 1.0f});
+        set_radiance(paths, k, {});
+        paths->pdf[k] = 0.0f;
+        paths->pixel[k] = pixel;
+        paths->depth[k] = 0;
     }
-    i32 n = get_nprocs() - 1;
-    if ((n < 2) || (MAX_THREADS < n)) {
-        exit(EXIT_FAILURE);
+}
+
+// NOTE: Live paths are traced `SIMD_WIDTH` at a time, in launch order,
+// through the same packet walk as the primary rays of `render_packet`. Lanes
+// past the last path start with a `t` of zero, so they never hit or keep a
+// node open.
+static void trace_paths(const Scene* scene,
+                        Wavefront*   wavefront,
+                        Counters*    counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < wavefront->n_paths; i += SIMD_WIDTH) {
+        f32 origin_x[SIMD_WIDTH];
+        f32 origin_y[SIMD_WIDTH];
+        f32 origin_z[SIMD_WIDTH];
+        f32 direction_x[SIMD_WIDTH];
+        f32 direction_y[SIMD_WIDTH];
+        f32 direction_z[SIMD_WIDTH];
+        f32 t_active[SIMD_WIDTH];
+        f32 t_nearest[SIMD_WIDTH];
+        u32 index[SIMD_WIDTH];
+        for (u32 j = 0; j < SIMD_WIDTH; ++j) {
+            if (wavefront->n_paths <= (i + j)) {
+                origin_x[j] = 0.0f;
+                origin_y[j] = 0.0f;
+                origin_z[j] = 0.0f;
+                direction_x[j] = 1.0f;
+                direction_y[j] = 1.0f;
+                direction_z[j] = 1.0f;
+                t_active[j] = 0.0f;
+                continue;
+            }
+            const u32 k = wavefront->live[i + j];
+            origin_x[j] = paths->origin_x[k];
+            origin_y[j] = paths->origin_y[k];
+            origin_z[j] = paths->origin_z[k];
+            direction_x[j] = paths->direction_x[k];
+            direction_y[j] = paths->direction_y[k];
+            direction_z[j] = paths->direction_z[k];
+            t_active[j] = F32_MAX;
+        }
+        RayPacket packet;
+        packet.origin_x = load(origin_x);
+        packet.origin_y = load(origin_y);
+        packet.origin_z = load(origin_z);
+        packet.direction_x = load(direction_x);
+        packet.direction_y = load(direction_y);
+        packet.direction_z = load(direction_z);
+        packet.inverse_x = get_inverse(packet.direction_x);
+        packet.inverse_y = get_inverse(packet.direction_y);
+        packet.inverse_z = get_inverse(packet.direction_z);
+        packet.a = (packet.direction_x * packet.direction_x) +
+                   (packet.direction_y * packet.direction_y) +
+                   (packet.direction_z * packet.direction_z);
+        f32x8 t = load(t_active);
+        f32x8 nearest = set_bits(scene->n_spheres);
+        get_nearest_hits(scene, &packet, &t, &nearest, counts);
+        store(t_nearest, t);
+        store_bits(index, nearest);
+        for (u32 j = 0; (j < SIMD_WIDTH) && ((i + j) < wavefront->n_paths);
+             ++j)
+        {
+            const u32 k = wavefront->live[i + j];
+            paths->t[k] = t_nearest[j];
+            paths->index[k] = index[j];
+        }
     }
-    for (u8 i = 0; i < n; ++i) {
-        pthread_create(&memory->threads[i], null, thread_render, &payload);
+}
+
+static void intersect_paths(const Scene*    scene,
+                            const Sampling* sampling,
+                            Wavefront*      wavefront,
+                            Counters*       counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < N_MATERIALS; ++i) {
+        wavefront->n_queued[i] = 0;
     }
-    for (u8 i = 0; i < n; ++i) {
-        pthread_join(memory->threads[i], null);
+    counts->n_rays += wavefront->n_paths;
+    trace_paths(scene, wavefront, counts);
+    for (u32 i = 0; i < wavefront->n_paths; ++i) {
+        const u32 k = wavefront->live[i];
+        const Ray ray = get_ray(paths, k);
+        if (wavefront->aovs && (paths->depth[k] == 0)) {
+            add_aov(&wavefront->aovs[paths->pixel[k]],
+                    scene,
+                    &ray,
+                    paths->t[k],
+                    paths->index[k]);
+        }
+        if (paths->index[k] == scene->n_spheres) {
+            COUNT(count_depth(counts, paths->depth[k]));
+            RgbColor radiance = get_radiance(paths, k);
+            radiance += get_attenuation(paths, k) * get_sky(ray.direction);
+            add_sample(&wavefront->stats[paths->pixel[k]], radiance);
+            paths->depth[k] = sampling->n_bounces;
+            continue;
+        }
+        ++counts->n_bounces;
+        const u32 material =
+            scene->surfaces[scene->surface[paths->index[k]]].material;
+        COUNT(++counts->n_scatters[material]);
+        wavefront->queues[material][wavefront->n_queued[material]++] = k;
     }
 }
 
-static void* alloc(usize size) {
-    void* memory = mmap(null,
-                        size,
-                        PROT_READ | PROT_WRITE,
-                        MAP_ANONYMOUS | MAP_PRIVATE,
-                        -1,
-                        0);
-    if (memory == MAP_FAILED) {
-        _exit(EXIT_FAILURE);
+static void set_depth(const Sampling* sampling,
+                      Wavefront*      wavefront,
+                      u32             k,
+                      Counters*       counts) {
+    Paths*   paths = &wavefront->paths;
+    RgbColor attenuation = get_attenuation(paths, k);
+    if (get_roulette(
+            sampling, ++paths->depth[k], &attenuation, &paths->rng[k]))
+    {
+        ++counts->n_roulette;
+        COUNT(count_depth(counts, paths->depth[k]));
+        add_sample(&wavefront->stats[paths->pixel[k]],
+                   get_radiance(paths, k));
+        paths->depth[k] = sampling->n_bounces;
+        return;
+    }
+    set_attenuation(paths, k, attenuation);
+    if (sampling->n_bounces <= paths->depth[k]) {
+        COUNT(++counts->n_exhausted);
+        COUNT(count_depth(counts, paths->depth[k]));
+        RgbColor radiance = get_radiance(paths, k);
+        radiance += attenuation;
+        add_sample(&wavefront->stats[paths->pixel[k]], radiance);
     }
-    return memory;
 }
 
-i32 main(i32 n, const char** args) {
-    printf("sizeof(void*)    : %zu\n"
-           "sizeof(Vec3)     : %zu\n"
-           "sizeof(RgbColor) : %zu\n"
-           "sizeof(Material) : %zu\n"
-           "sizeof(Features) : %zu\n"
-           "sizeof(Hit)      : %zu\n"
-           "sizeof(Sphere)   : %zu\n"
-           "sizeof(Camera)   : %zu\n"
+static void shade_lambertian(const Scene*    scene,
+                             const Sampling* sampling,
+                             Wavefront*      wavefront,
+                             Counters*       counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < wavefront->n_queued[LAMBERTIAN]; ++i) {
+        const u32 k = wavefront->queues[LAMBERTIAN][i];
+        Ray       ray = get_ray(paths, k);
+        RgbColor  attenuation = get_attenuation(paths, k);
+        Hit       hit;
+        set_hit(scene, paths->index[k], &ray, &hit, paths->t[k]);
+        set_bounce(&paths->rng[k], paths->depth[k]);
+        scatter_lambertian(&hit, &ray, &attenuation, &paths->rng[k]);
+        if (scene->n_lights != 0) {
+            RgbColor radiance = get_radiance(paths, k);
+            radiance += attenuation * get_direct(scene,
+                                                 &hit,
+                                                 paths->depth[k],
+                                                 counts,
+                                                 &paths->rng[k]);
+            set_radiance(paths, k, radiance);
+            paths->pdf[k] = get_lambertian_pdf(&hit, ray.direction);
+        }
+        set_ray(paths, k, &ray);
+        set_attenuation(paths, k, attenuation);
+        set_depth(sampling, wavefront, k, counts);
+    }
+}
+
+static void shade_metal(const Scene*    scene,
+                        const Sampling* sampling,
+                        Wavefront*      wavefront,
+                        Counters*       counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < wavefront->n_queued[METAL]; ++i) {
+        const u32 k = wavefront->queues[METAL][i];
+        Ray       ray = get_ray(paths, k);
+        RgbColor  attenuation = get_attenuation(paths, k);
+        Hit       hit;
+        set_hit(scene, paths->index[k], &ray, &hit, paths->t[k]);
+        set_bounce(&paths->rng[k], paths->depth[k]);
+        if (!scatter_metal(&hit, &ray, &attenuation, &paths->rng[k])) {
+            COUNT(++counts->n_absorbed);
+            COUNT(count_depth(counts, paths->depth[k] + 1));
+            add_sample(&wavefront->stats[paths->pixel[k]],
+                       get_radiance(paths, k));
+            paths->depth[k] = sampling->n_bounces;
+            continue;
+        }
+        paths->pdf[k] = 0.0f;
+        set_ray(paths, k, &ray);
+        set_attenuation(paths, k, attenuation);
+        set_depth(sampling, wavefront, k, counts);
+    }
+}
+
+static void shade_dielectric(const Scene*    scene,
+                             const Sampling* sampling,
+                             Wavefront*      wavefront,
+                             Counters*       counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < wavefront->n_queued[DIELECTRIC]; ++i) {
+        const u32 k = wavefront->queues[DIELECTRIC][i];
+        Ray       ray = get_ray(paths, k);
+        Hit       hit;
+        set_hit(scene, paths->index[k], &ray, &hit, paths->t[k]);
+        set_bounce(&paths->rng[k], paths->depth[k]);
+        scatter_dielectric(&hit, &ray, &paths->rng[k]);
+        paths->pdf[k] = 0.0f;
+        set_ray(paths, k, &ray);
+        set_depth(sampling, wavefront, k, counts);
+    }
+}
+
+static void shade_emissive(const Scene*    scene,
+                           const Sampling* sampling,
+                           Wavefront*      wavefront,
+                           Counters*       counts) {
+    Paths* paths = &wavefront->paths;
+    for (u32 i = 0; i < wavefront->n_queued[EMISSIVE]; ++i) {
+        const u32 k = wavefront->queues[EMISSIVE][i];
+        const Ray ray = get_ray(paths, k);
+        const u32 index = paths->index[k];
+        RgbColor  radiance = get_radiance(paths, k);
+        radiance += get_attenuation(paths, k) *
+                    scene->surfaces[scene->surface[index]].albedo *
+                    get_emitted_weight(scene, &ray, index, paths->pdf[k]);
+        COUNT(count_depth(counts, paths->depth[k] + 1));
+        add_sample(&wavefront->stats[paths->pixel[k]], radiance);
+        paths->depth[k] = sampling->n_bounces;
+    }
+}
+
+static void compact_paths(const Sampling* sampling, Wavefront* wavefront) {
+    const Paths* paths = &wavefront->paths;
+    u32          n = 0;
+    for (u32 i = 0; i < wavefront->n_paths; ++i) {
+        const u32 k = wavefront->live[i];
+        if (sampling->n_bounces <= paths->depth[k]) {
+            wavefront->free[wavefront->n_free++] = k;
+            continue;
+        }
+        wavefront->live[n++] = k;
+    }
+    wavefront->n_paths = n;
+}
+
+// NOTE: Alternative to `render_block`; instead of following one sample at a
+// time through every bounce, up to `WAVEFRONT_PATHS` live paths advance in
+// lockstep through separate stages (generate, intersect, shade per material,
+// compact) so each stage runs one tight loop over its own queue, and every
+// bounce, not just the first, is traced in packets.
+static void render_wavefront(const Camera*   camera,
+                             const Scene*    scene,
+                             const Sampling* sampling,
+                             Pixel*          pixels,
+                             PixelStats*     accumulation,
+                             Aov*            aovs,
+                             Block           block,
+                             Wavefront*      wavefront,
+                             Counters*       counts) {
+    const u32 width = block.end.x - block.start.x;
+    const u32 n_pixels = width * (block.end.y - block.start.y);
+    const u32 offset = block.start.x + (block.start.y * camera->width);
+    for (u32 i = 0; i < n_pixels; ++i) {
+        wavefront->stats[i] =
+            accumulation ? accumulation[offset + (i % width) +
+                                        ((i / width) * camera->width)]
+                         : PixelStats{};
+        wavefront->launched[i] = wavefront->stats[i].n;
+        if (aovs) {
+            wavefront->aovs[i] =
+                aovs[offset + (i % width) + ((i / width) * camera->width)];
+        }
+    }
+    for (u32 i = 0; i < WAVEFRONT_PATHS; ++i) {
+        wavefront->free[i] = WAVEFRONT_PATHS - 1 - i;
+    }
+    wavefront->n_paths = 0;
+    wavefront->n_free = WAVEFRONT_PATHS;
+    wavefront->cursor = 0;
+    for (;;) {
+        generate_paths(camera, sampling, block, wavefront, counts);
+        if (wavefront->n_paths == 0) {
+            break;
+        }
+        intersect_paths(scene, sampling, wavefront, counts);
+        shade_lambertian(scene, sampling, wavefront, counts);
+        shade_metal(scene, sampling, wavefront, counts);
+        shade_dielectric(scene, sampling, wavefront, counts);
+        shade_emissive(scene, sampling, wavefront, counts);
+        compact_paths(sampling, wavefront);
+    }
+    u64 n_samples = 0;
+    for (u32 i = 0; i < n_pixels; ++i) {
+        set_pixel(&pixels[i], &wavefront->stats[i]);
+        n_samples += wavefront->stats[i].n;
+        if (accumulation) {
+            PixelStats* accumulated =
+                &accumulation[offset + (i % width) +
+                              ((i / width) * camera->width)];
+            n_samples -= accumulated->n;
+            *accumulated = wavefront->stats[i];
+        }
+        if (aovs) {
+            aovs[offset + (i % width) + ((i / width) * camera->width)] =
+                wavefront->aovs[i];
+        }
+    }
+    N_SAMPLES.fetch_add(n_samples, SEQ_CST);
+}
+
+static u64 get_nanoseconds() {
+    TimeSpec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (static_cast<u64>(time.tv_sec) * 1000000000ul) +
+           static_cast<u64>(time.tv_nsec);
+}
+
+static u64 get_range(u32 head, u32 tail) {
+    return (static_cast<u64>(tail) << 32) | head;
+}
+
+static bool pop_block(Deque* deque, u32* index) {
+    u64 range = deque->range.load(RELAXED);
+    for (;;) {
+        const u32 head = static_cast<u32>(range);
+        const u32 tail = static_cast<u32>(range >> 32);
+        if (tail <= head) {
+            return false;
+        }
+        if (deque->range.compare_exchange_weak(range,
+                                               get_range(head + 1, tail),
+                                               RELAXED,
+                                               RELAXED))
+        {
+            *index = head;
+            return true;
+        }
+    }
+}
+
+// NOTE: Only the owner refills its own deque, and only once it is empty, so
+// the stolen range can be published with a plain store. Ranges only ever
+// shrink or move to unclaimed blocks, which rules out ABA on the CAS.
+static bool steal_blocks(Deque* victim, Deque* deque) {
+    u64 range = victim->range.load(RELAXED);
+    for (;;) {
+        const u32 head = static_cast<u32>(range);
+        const u32 tail = static_cast<u32>(range >> 32);
+        if (tail <= head) {
+            return false;
+        }
+        const u32 middle = tail - ((tail - head + 1) / 2);
+        if (victim->range.compare_exchange_weak(range,
+                                                get_range(head, middle),
+                                                RELAXED,
+                                                RELAXED))
+        {
+            deque->range.store(get_range(middle, tail), RELAXED);
+            return true;
+        }
+    }
+}
+
+static bool get_block(Deque*  deques,
+                      u32     n_threads,
+                      u32     thread_index,
+                      Worker* worker,
+                      u32*    index) {
+    if (pop_block(&deques[thread_index], index)) {
+        return true;
+    }
+    for (u32 i = 1; i < n_threads; ++i) {
+        if (steal_blocks(&deques[(thread_index + i) % n_threads],
+                         &deques[thread_index]))
+        {
+            ++worker->n_stolen;
+            return pop_block(&deques[thread_index], index);
+        }
+    }
+    return false;
+}
+
+// NOTE: The last block to finish a row of blocks starts writeback for those
+// rows, so the file streams out while the rest of the frame renders.
+static void write_block(Frame* frame, const Pixel* tile, Block block) {
+    const u32 width = block.end.x - block.start.x;
+    for (u32 y = block.start.y; y < block.end.y; ++y) {
+        memcpy(&get_row(&frame->image, y)[block.start.x],
+               &tile[(y - block.start.y) * width],
+               width * sizeof(Pixel));
+    }
+    u32Atomic* band = &frame->bands[block.start.y / frame->block_height];
+    if ((band->fetch_add(1, SEQ_CST) + 1) == frame->x_blocks) {
+        flush_rows(&frame->image, block.start.y, block.end.y);
+    }
+}
+
+static void render_blocks(Worker* worker) {
+    Pool*           pool = worker->pool;
+    const Payload*  payload = pool->payload;
+    Frame*          frame = payload->frame;
+    const Camera*   camera = payload->camera;
+    const Scene*    scene = payload->scene;
+    const Sampling* sampling = payload->sampling;
+    const u32       thread_index = worker->index;
+    Wavefront*      wavefront = &pool->wavefronts[thread_index];
+    Pixel*          tile = &frame->tiles[thread_index * frame->block_pixels];
+    const u64       start = get_nanoseconds();
+    for (;;) {
+        // NOTE: The clock is read once per block anyway, so checking the
+        // deadline here costs one compare; blocks left over keep whatever
+        // the previous pass wrote for them.
+        const u64 block_start = get_nanoseconds();
+        u32       index;
+        if ((payload->deadline <= block_start) ||
+            !get_block(
+                pool->deques, pool->n_threads, thread_index, worker, &index))
+        {
+            break;
+        }
+        const Block block = frame->blocks[index];
+        if (payload->wavefront) {
+            render_wavefront(camera,
+                             scene,
+                             sampling,
+                             tile,
+                             frame->accumulation,
+                             frame->aovs,
+                             block,
+                             wavefront,
+                             &worker->counters);
+        } else {
+            payload->kernel->render_block(camera,
+                                          scene,
+                                          sampling,
+                                          tile,
+                                          frame->accumulation,
+                                          frame->aovs,
+                                          block,
+                                          &worker->counters);
+        }
+        write_block(frame, tile, block);
+        const u64 elapsed = get_nanoseconds() - block_start;
+        frame->block_times[index] += elapsed;
+        worker->busy += elapsed;
+        ++worker->n_blocks;
+    }
+    worker->finish += get_nanoseconds() - start;
+}
+
+// NOTE: Zeroes this thread's own slabs and the run of Morton blocks that
+// `set_pixels` first hands it, so that every page it is going to write
+// (accumulation, guides and image rows) lands on its own socket rather than
+// wherever the main thread happens to run.
+static void touch_blocks(Worker* worker) {
+    Pool*       pool = worker->pool;
+    Frame*      frame = pool->payload->frame;
+    const u32   index = worker->index;
+    const usize offset = static_cast<usize>(index) * frame->block_pixels;
+    memset(&frame->tiles[offset], 0, sizeof(Pixel) * frame->block_pixels);
+    memset(&frame->stats[offset], 0, sizeof(PixelStats) * frame->block_pixels);
+    memset(&frame->launched[offset], 0, sizeof(u32) * frame->block_pixels);
+    if (frame->aov_tiles) {
+        memset(&frame->aov_tiles[offset],
+               0,
+               sizeof(Aov) * frame->block_pixels);
+    }
+    memset(&pool->wavefronts[index], 0, sizeof(Wavefront));
+    const u32 first = (index * frame->n_blocks) / pool->n_threads;
+    const u32 last = ((index + 1) * frame->n_blocks) / pool->n_threads;
+    const u32 width = frame->image.width;
+    for (u32 i = first; i < last; ++i) {
+        const Block block = frame->blocks[i];
+        const u32   n_pixels = block.end.x - block.start.x;
+        for (u32 y = block.start.y; y < block.end.y; ++y) {
+            const u32 pixel = block.start.x + (y * width);
+            memset(&get_row(&frame->image, y)[block.start.x],
+                   0,
+                   sizeof(Pixel) * n_pixels);
+            if (frame->accumulation) {
+                memset(&frame->accumulation[pixel],
+                       0,
+                       sizeof(PixelStats) * n_pixels);
+            }
+            if (frame->aovs) {
+                memset(&frame->aovs[pixel], 0, sizeof(Aov) * n_pixels);
+            }
+        }
+    }
+}
+
+static f32* get_plane(const Frame* frame, u32 plane, u32 y) {
+    return &frame->planes[(((y * N_PLANES) + plane) * frame->plane_stride) +
+                          DENOISE_APRON];
+}
+
+// NOTE: Loads the mean colour, clamped the way `set_pixel` will clamp it,
+// and the mean albedo and normal of row `y`. Columns outside the image get a
+// normal of `DENOISE_FAR`, which no weight survives, so the filter needs no
+// bounds checks along a row.
+static void set_planes(const Frame* frame, u32 y) {
+    const u32 width = frame->image.width;
+    const u32 stride = frame->plane_stride;
+    const u32 end = stride - (2 * DENOISE_APRON);
+    for (u32 i = 0; i < N_PLANES; ++i) {
+        f32*      plane = get_plane(frame, i, y);
+        const f32 outside =
+            (PLANE_NORMAL <= i) && (i < PLANE_COLOR) ? DENOISE_FAR : 0.0f;
+        for (u32 x = 0; x < DENOISE_APRON; ++x) {
+            plane[-1 - static_cast<i32>(x)] = outside;
+        }
+        for (u32 x = width; x < end + DENOISE_APRON; ++x) {
+            plane[x] = outside;
+        }
+    }
+    f32* albedo = get_plane(frame, PLANE_ALBEDO, y);
+    f32* normal = get_plane(frame, PLANE_NORMAL, y);
+    f32* color = get_plane(frame, PLANE_COLOR, y);
+    for (u32 x = 0; x < width; ++x) {
+        const PixelStats* stats = &frame->accumulation[(y * width) + x];
+        const Aov*        aov = &frame->aovs[(y * width) + x];
+        RgbColor          mean = stats->sum;
+        mean /= static_cast<f32>(stats->n);
+        clamp(&mean, 0.0f, 1.0f);
+        const f32 scale = 1.0f / static_cast<f32>(aov->n);
+        color[x] = mean.red;
+        color[x + stride] = mean.green;
+        color[x + (2 * stride)] = mean.blue;
+        albedo[x] = aov->albedo.red * scale;
+        albedo[x + stride] = aov->albedo.green * scale;
+        albedo[x + (2 * stride)] = aov->albedo.blue * scale;
+        normal[x] = aov->normal.x * scale;
+        normal[x + stride] = aov->normal.y * scale;
+        normal[x + (2 * stride)] = aov->normal.z * scale;
+    }
+}
+
+// NOTE: Stands in for `exp(-x)`; it reaches zero at `x = 16`, which is what
+// lets `DENOISE_FAR` cut taps off entirely.
+static f32x8 get_falloff(f32x8 x) {
+    f32x8 y = max(set1(1.0f) - (x * set1(1.0f / 16.0f)), set1(0.0f));
+    y = y * y;
+    y = y * y;
+    y = y * y;
+    return y * y;
+}
+
+static f32x8 get_distance(const f32* a, const f32* b, u32 stride, u32 x) {
+    const f32x8 delta_0 = load(&a[x]) - load(&b[x]);
+    const f32x8 delta_1 = load(&a[x + stride]) - load(&b[x + stride]);
+    const f32x8 delta_2 =
+        load(&a[x + (2 * stride)]) - load(&b[x + (2 * stride)]);
+    return (delta_0 * delta_0) + (delta_1 * delta_1) + (delta_2 * delta_2);
+}
+
+// NOTE: One pass of the edge-avoiding à-trous filter over row `y`: a 5x5
+// B-spline kernel with its taps `1 << pass` pixels apart, each weighted down
+// by how far its albedo, normal and colour stray from the centre pixel's.
+// The colour tolerance halves every pass, as the colour it compares against
+// gets smoother.
+static void filter_row(const Frame* frame, u32 y, u32 pass) {
+    static const f32 KERNEL[] = {
+        1.0f / 16.0f,
+        1.0f / 4.0f,
+        3.0f / 8.0f,
+        1.0f / 4.0f,
+        1.0f / 16.0f,
+    };
+    const u32   stride = frame->plane_stride;
+    const u32   end = stride - (2 * DENOISE_APRON);
+    const u32   step = 1u << pass;
+    const u32   source = PLANE_COLOR + ((pass & 1) * 3);
+    const u32   target = PLANE_COLOR + (((pass + 1) & 1) * 3);
+    const f32x8 color_scale = set1(static_cast<f32>(1u << (2 * pass)) /
+                                   (DENOISE_COLOR * DENOISE_COLOR));
+    const f32x8 normal_scale = set1(1.0f / DENOISE_NORMAL);
+    const f32x8 albedo_scale = set1(1.0f / DENOISE_ALBEDO);
+    const f32*  albedo = get_plane(frame, PLANE_ALBEDO, y);
+    const f32*  normal = get_plane(frame, PLANE_NORMAL, y);
+    const f32*  color = get_plane(frame, source, y);
+    f32*        output = get_plane(frame, target, y);
+    for (u32 x = 0; x < end; x += SIMD_WIDTH) {
+        f32x8 weights = set1(0.0f);
+        f32x8 red = set1(0.0f);
+        f32x8 green = set1(0.0f);
+        f32x8 blue = set1(0.0f);
+        for (i32 j = -2; j <= 2; ++j) {
+            const i32 row = static_cast<i32>(y) + (j * static_cast<i32>(step));
+            if ((row < 0) || (static_cast<i32>(frame->image.height) <= row)) {
+                continue;
+            }
+            const u32  v = static_cast<u32>(row);
+            const f32* tap_albedo = get_plane(frame, PLANE_ALBEDO, v);
+            const f32* tap_normal = get_plane(frame, PLANE_NORMAL, v);
+            const f32* tap_color = get_plane(frame, source, v);
+            for (i32 i = -2; i <= 2; ++i) {
+                const i32 offset = i * static_cast<i32>(step);
+                // NOTE: Pointers are shifted rather than `x`, which stays
+                // unsigned; the apron keeps every shifted load in bounds.
+                const f32*  a = &tap_albedo[offset];
+                const f32*  b = &tap_normal[offset];
+                const f32*  c = &tap_color[offset];
+                const f32x8 distance =
+                    (get_distance(a, albedo, stride, x) * albedo_scale) +
+                    (get_distance(b, normal, stride, x) * normal_scale) +
+                    (get_distance(c, color, stride, x) * color_scale);
+                const f32x8 weight = set1(KERNEL[i + 2] * KERNEL[j + 2]) *
+                                     get_falloff(distance);
+                const f32*  tap = &c[x];
+                weights = weights + weight;
+                red = red + (weight * load(tap));
+                green = green + (weight * load(&tap[stride]));
+                blue = blue + (weight * load(&tap[2 * stride]));
+            }
+        }
+        store(&output[x], red / weights);
+        store(&output[x + stride], green / weights);
+        store(&output[x + (2 * stride)], blue / weights);
+    }
+}
+
+// NOTE: Each thread takes a fixed band of rows, loads their planes, filters
+// them once per pass and finally writes them over the noisy image. Every
+// pass reads rows that other threads wrote in the one before, so the passes
+// are separated by `ready`.
+static void denoise_rows(Worker* worker) {
+    Pool*     pool = worker->pool;
+    Frame*    frame = pool->payload->frame;
+    const u32 height = frame->image.height;
+    const u32 first = (worker->index * height) / pool->n_threads;
+    const u32 last = ((worker->index + 1) * height) / pool->n_threads;
+    for (u32 y = first; y < last; ++y) {
+        set_planes(frame, y);
+    }
+    for (u32 pass = 0; pass < DENOISE_PASSES; ++pass) {
+        pthread_barrier_wait(&pool->ready);
+        for (u32 y = first; y < last; ++y) {
+            filter_row(frame, y, pass);
+        }
+    }
+    const u32 result = PLANE_COLOR + ((DENOISE_PASSES & 1) * 3);
+    for (u32 y = first; y < last; ++y) {
+        const f32* color = get_plane(frame, result, y);
+        Pixel*     row = get_row(&frame->image, y);
+        for (u32 x = 0; x < frame->image.width; ++x) {
+            set_pixel(&row[x],
+                      {
+                          color[x],
+                          color[x + frame->plane_stride],
+                          color[x + (2 * frame->plane_stride)],
+                      });
+        }
+    }
+    if (first < last) {
+        flush_rows(&frame->image, first, last);
+    }
+}
+
+static void* thread_work(void* payload) {
+    Worker* worker = reinterpret_cast<Worker*>(payload);
+    Pool*   pool = worker->pool;
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit) {
+            return null;
+        }
+        switch (pool->payload->work) {
+        case WORK_RENDER: {
+            render_blocks(worker);
+            break;
+        }
+        case WORK_TOUCH: {
+            touch_blocks(worker);
+            break;
+        }
+        case WORK_DENOISE: {
+            denoise_rows(worker);
+            break;
+        }
+        }
+        pthread_barrier_wait(&pool->finish);
+    }
+}
+
+static u32 get_socket(u32 cpu) {
+    char path[64];
+    snprintf(path,
+             sizeof(path),
+             "/sys/devices/system/cpu/cpu%u/topology/physical_package_id",
+             cpu);
+    File* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    u32 socket = 0;
+    if (fscanf(file, "%u", &socket) != 1) {
+        socket = 0;
+    }
+    fclose(file);
+    return socket;
+}
+
+// NOTE: Threads are laid out socket by socket, so the contiguous deque ranges
+// handed out in `set_pixels` (and the framebuffer slabs they first-touch)
+// stay on one socket each.
+static void start_pool(Pool* pool, u32 n_threads) {
+    CpuSet set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    u32 cpus[CPU_SETSIZE];
+    u32 sockets[CPU_SETSIZE];
+    u32 n_cpus = 0;
+    for (u32 i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &set)) {
+            continue;
+        }
+        const u32 socket = get_socket(i);
+        u32       j = n_cpus++;
+        for (; (0 < j) && (socket < sockets[j - 1]); --j) {
+            cpus[j] = cpus[j - 1];
+            sockets[j] = sockets[j - 1];
+        }
+        cpus[j] = i;
+        sockets[j] = socket;
+    }
+    if (n_cpus == 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (n_threads == 0) {
+        n_threads = n_cpus;
+    }
+    pool->threads =
+        reinterpret_cast<Thread*>(alloc(sizeof(Thread) * n_threads));
+    pool->workers =
+        reinterpret_cast<Worker*>(alloc(sizeof(Worker) * n_threads));
+    pool->deques = reinterpret_cast<Deque*>(alloc(sizeof(Deque) * n_threads));
+    pool->wavefronts =
+        reinterpret_cast<Wavefront*>(alloc(sizeof(Wavefront) * n_threads));
+    pool->payload = null;
+    pool->n_threads = n_threads;
+    pool->n_sockets = 1;
+    pool->quit = false;
+    pthread_barrier_init(&pool->start, null, n_threads + 1);
+    pthread_barrier_init(&pool->ready, null, n_threads);
+    pthread_barrier_init(&pool->finish, null, n_threads + 1);
+    for (u32 i = 0; i < n_threads; ++i) {
+        const u32 k = (i * n_cpus) / n_threads;
+        if ((0 < i) && (sockets[k] != pool->workers[i - 1].socket)) {
+            ++pool->n_sockets;
+        }
+        pool->workers[i] = {pool, i, cpus[k], sockets[k], 0, 0, 0, 0, {}};
+        CpuSet affinity;
+        CPU_ZERO(&affinity);
+        CPU_SET(cpus[k], &affinity);
+        ThreadAttr attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setaffinity_np(&attributes, sizeof(affinity), &affinity);
+        if (pthread_create(&pool->threads[i],
+                           &attributes,
+                           thread_work,
+                           &pool->workers[i]) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attributes);
+    }
+}
+
+// NOTE: The main thread has nothing else to do while a frame renders, so it
+// finishes writing the `previous` one in the meantime, if there is one.
+static void run_pool(Pool* pool, const Payload* payload, BmpImage* previous) {
+    pool->payload = payload;
+    pthread_barrier_wait(&pool->start);
+    if (previous) {
+        sync_bmp(previous);
+        close_bmp(previous);
+    }
+    pthread_barrier_wait(&pool->finish);
+}
+
+static void stop_pool(Pool* pool) {
+    pool->quit = true;
+    pthread_barrier_wait(&pool->start);
+    for (u32 i = 0; i < pool->n_threads; ++i) {
+        pthread_join(pool->threads[i], null);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->ready);
+    pthread_barrier_destroy(&pool->finish);
+}
+
+static u32 get_compact(u32 x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+}
+
+static Camera get_camera(const Config* config) {
+    const f32  theta = degrees_to_radians(config->vertical_fov);
+    const f32  h = tanf(theta / 2.0f);
+    const f32  width = static_cast<f32>(config->width);
+    const f32  height = static_cast<f32>(config->height);
+    const f32  viewport_height = 2.0f * h;
+    const f32  viewport_width = (width / height) * viewport_height;
+    const Vec3 w = unit(config->look_from - config->look_at);
+    const Vec3 u = unit(cross(config->up, w));
+    const Vec3 v = cross(w, u);
+    const Vec3 origin = config->look_from;
+    const f32  focus_distance = len(config->look_from - config->look_at);
+    const Vec3 horizontal = focus_distance * viewport_width * u;
+    const Vec3 vertical = focus_distance * viewport_height * v;
+    return {
+        u,
+        v,
+        origin,
+        horizontal / width,
+        vertical / height,
+        origin - (horizontal / 2.0f) - (vertical / 2.0f) -
+            (focus_distance * w),
+        config->aperture / 2.0f,
+        config->width,
+    };
+}
+
+// NOTE: One camera keyframe per line, `#` starts a comment:
+//
+//     key <time> <look from x y z> <look at x y z> <vertical fov>
+//
+// with times strictly increasing.
+struct Key {
+    f32  time;
+    Vec3 look_from;
+    Vec3 look_at;
+    f32  vertical_fov;
+};
+
+// NOTE: `n_frames` frames spread evenly over the keys' time range.
+struct Sequence {
+    Key* keys;
+    u32  n_keys;
+    u32  n_frames;
+};
+
+static bool read_key(File* file, Key* key) {
+    char line[KEY_LINE];
+    for (;;) {
+        if (!fgets(line, KEY_LINE, file)) {
+            return false;
+        }
+        char kind[16];
+        if ((sscanf(line, " %15s", kind) != 1) || (kind[0] == '#')) {
+            continue;
+        }
+        if ((strcmp(kind, "key") != 0) ||
+            (sscanf(line,
+                    " key %f %f %f %f %f %f %f %f",
+                    &key->time,
+                    &key->look_from.x,
+                    &key->look_from.y,
+                    &key->look_from.z,
+                    &key->look_at.x,
+                    &key->look_at.y,
+                    &key->look_at.z,
+                    &key->vertical_fov) != 8))
+        {
+            exit(EXIT_FAILURE);
+        }
+        return true;
+    }
+}
+
+static void read_keys(Sequence* sequence, const char* path) {
+    File* file = fopen(path, "r");
+    if (!file) {
+        exit(EXIT_FAILURE);
+    }
+    Key key;
+    u32 n_keys = 0;
+    while (read_key(file, &key)) {
+        ++n_keys;
+    }
+    if (n_keys == 0) {
+        exit(EXIT_FAILURE);
+    }
+    sequence->keys = reinterpret_cast<Key*>(alloc(sizeof(Key) * n_keys));
+    sequence->n_keys = n_keys;
+    rewind(file);
+    for (u32 i = 0; i < n_keys; ++i) {
+        if ((!read_key(file, &sequence->keys[i])) ||
+            (sequence->keys[i].vertical_fov <= 0.0f) ||
+            (180.0f <= sequence->keys[i].vertical_fov) ||
+            ((0 < i) &&
+             (sequence->keys[i].time <= sequence->keys[i - 1].time)))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file);
+}
+
+// NOTE: A uniform Catmull-Rom segment from `b` to `c`, so the camera passes
+// through every key with no jump in direction.
+static f32 get_spline(f32 a, f32 b, f32 c, f32 d, f32 t) {
+    return 0.5f * ((2.0f * b) + ((c - a) * t) +
+                   (((2.0f * a) - (5.0f * b) + (4.0f * c) - d) * t * t) +
+                   (((3.0f * (b - c)) + d - a) * t * t * t));
+}
+
+static Vec3 get_spline(Vec3 a, Vec3 b, Vec3 c, Vec3 d, f32 t) {
+    return {
+        get_spline(a.x, b.x, c.x, d.x, t),
+        get_spline(a.y, b.y, c.y, d.y, t),
+        get_spline(a.z, b.z, c.z, d.z, t),
+    };
+}
+
+// NOTE: The first and last keys are repeated past either end, and times
+// outside the keys' range hold on them.
+static void set_view(Config* config, const Sequence* sequence, f32 time) {
+    const Key* keys = sequence->keys;
+    const u32  last = sequence->n_keys - 1;
+    u32        i = 0;
+    while ((i < last) && (keys[i + 1].time <= time)) {
+        ++i;
+    }
+    const Key* b = &keys[i];
+    const Key* a = &keys[0 < i ? i - 1 : i];
+    const Key* c = &keys[i < last ? i + 1 : i];
+    const Key* d = &keys[(i + 1) < last ? i + 2 : last];
+    f32        t = 0.0f;
+    if (b->time < c->time) {
+        t = (time - b->time) / (c->time - b->time);
+        t = t < 0.0f ? 0.0f : t;
+    }
+    config->look_from =
+        get_spline(a->look_from, b->look_from, c->look_from, d->look_from, t);
+    config->look_at =
+        get_spline(a->look_at, b->look_at, c->look_at, d->look_at, t);
+    config->vertical_fov = get_spline(a->vertical_fov,
+                                      b->vertical_fov,
+                                      c->vertical_fov,
+                                      d->vertical_fov,
+                                      t);
+}
+
+// NOTE: Frame `index` of `path` goes just before its extension, e.g.
+// `out/main.0007.bmp` for `out/main.bmp`.
+static const char* get_frame_path(char* buffer, const char* path, u32 index) {
+    const char* slash = strrchr(path, '/');
+    const char* dot = strrchr(path, '.');
+    if ((!dot) || (slash && (dot < slash))) {
+        dot = &path[strlen(path)];
+    }
+    if (FRAME_PATH <= static_cast<usize>(snprintf(buffer,
+                                                  FRAME_PATH,
+                                                  "%.*s.%04u%s",
+                                                  static_cast<i32>(dot - path),
+                                                  path,
+                                                  index,
+                                                  dot)))
+    {
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+static void set_tiling(Frame* frame, const Config* config) {
+    frame->x_blocks =
+        (config->width + config->block_width - 1) / config->block_width;
+    frame->y_blocks =
+        (config->height + config->block_height - 1) / config->block_height;
+    frame->n_blocks = frame->x_blocks * frame->y_blocks;
+    frame->block_pixels = config->block_width * config->block_height;
+    frame->block_height = config->block_height;
+}
+
+static u32 get_plane_stride(u32 width) {
+    return DENOISE_APRON +
+           ((width + SIMD_WIDTH - 1) & ~static_cast<u32>(SIMD_WIDTH - 1)) +
+           DENOISE_APRON;
+}
+
+static usize get_frame_size(const Config* config,
+                            u32           n_threads,
+                            bool          accumulate,
+                            bool          denoise) {
+    Frame frame;
+    set_tiling(&frame, config);
+    const usize n_pixels =
+        accumulate ? static_cast<usize>(config->width) * config->height : 0;
+    const usize n_tiles = static_cast<usize>(n_threads) * frame.block_pixels;
+    const usize n_guides = denoise ? n_pixels : 0;
+    const usize n_planes =
+        denoise ? static_cast<usize>(N_PLANES) *
+                      get_plane_stride(config->width) * config->height
+                : 0;
+    return get_arena_size(sizeof(PixelStats) * n_pixels) +
+           get_arena_size(sizeof(Aov) * n_guides) +
+           get_arena_size(sizeof(Aov) * (denoise ? n_tiles : 0)) +
+           get_arena_size(sizeof(f32) * n_planes) +
+           get_arena_size(sizeof(Pixel) * n_tiles) +
+           get_arena_size(sizeof(Block) * frame.n_blocks) +
+           get_arena_size(sizeof(PixelStats) * n_tiles) +
+           get_arena_size(sizeof(u32) * n_tiles) +
+           get_arena_size(sizeof(u32Atomic) * frame.y_blocks) +
+           get_arena_size(sizeof(u64) * frame.n_blocks);
+}
+
+static void set_frame(Frame*        frame,
+                      Arena*        arena,
+                      const Config* config,
+                      u32           n_threads,
+                      bool          accumulate,
+                      bool          denoise) {
+    set_tiling(frame, config);
+    const usize n_tiles = static_cast<usize>(n_threads) * frame->block_pixels;
+    frame->accumulation = null;
+    if (accumulate) {
+        frame->accumulation = reinterpret_cast<PixelStats*>(
+            push(arena,
+                 sizeof(PixelStats) * config->width * config->height));
+    }
+    frame->aovs = null;
+    frame->aov_tiles = null;
+    frame->planes = null;
+    frame->plane_stride = get_plane_stride(config->width);
+    if (denoise) {
+        frame->aovs = reinterpret_cast<Aov*>(
+            push(arena, sizeof(Aov) * config->width * config->height));
+        frame->aov_tiles =
+            reinterpret_cast<Aov*>(push(arena, sizeof(Aov) * n_tiles));
+        frame->planes = reinterpret_cast<f32*>(
+            push(arena,
+                 sizeof(f32) * N_PLANES * frame->plane_stride *
+                     config->height));
+    }
+    frame->tiles =
+        reinterpret_cast<Pixel*>(push(arena, sizeof(Pixel) * n_tiles));
+    frame->blocks =
+        reinterpret_cast<Block*>(push(arena, sizeof(Block) * frame->n_blocks));
+    frame->stats = reinterpret_cast<PixelStats*>(
+        push(arena, sizeof(PixelStats) * n_tiles));
+    frame->launched =
+        reinterpret_cast<u32*>(push(arena, sizeof(u32) * n_tiles));
+    frame->bands = reinterpret_cast<u32Atomic*>(
+        push(arena, sizeof(u32Atomic) * frame->y_blocks));
+    frame->block_times =
+        reinterpret_cast<u64*>(push(arena, sizeof(u64) * frame->n_blocks));
+    u32 index = 0;
+    for (u32 code = 0; index < frame->n_blocks; ++code) {
+        const u32 x = get_compact(code);
+        const u32 y = get_compact(code >> 1);
+        if ((frame->x_blocks <= x) || (frame->y_blocks <= y)) {
+            continue;
+        }
+        const Point start = {
+            x * config->block_width,
+            y * config->block_height,
+        };
+        Point end = {
+            start.x + config->block_width,
+            start.y + config->block_height,
+        };
+        end.x = end.x < config->width ? end.x : config->width;
+        end.y = end.y < config->height ? end.y : config->height;
+        const Block block = {
+            start,
+            end,
+        };
+        frame->blocks[index++] = block;
+    }
+    frame->first_block = 0;
+    frame->last_block = frame->n_blocks;
+}
+
+// NOTE: Followed by one `PixelStats` per pixel, row-major. Everything but
+// `n_samples`, the per-pixel sample budget reached so far, must match for a
+// job to resume from it; the threshold and budget may change between runs.
+struct CheckpointHeader {
+    u32    magic;
+    u32    version;
+    u64    seed;
+    Config config;
+    u32    n_bounces;
+    u32    roulette_depth;
+    u32    sampler;
+    u32    sample_bits;
+    u32    n_samples;
+};
+
+static void set_checkpoint_header(CheckpointHeader* header,
+                                  const Config*     config,
+                                  const Sampling*   sampling) {
+    memset(header, 0, sizeof(CheckpointHeader));
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->seed = sampling->seed;
+    header->config = *config;
+    header->n_bounces = sampling->n_bounces;
+    header->roulette_depth = sampling->roulette_depth;
+    header->sampler = sampling->sampler;
+    header->sample_bits = sampling->sample_bits;
+}
+
+static bool load_checkpoint(const char*       path,
+                            CheckpointHeader* header,
+                            PixelStats*       accumulation) {
+    File* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    CheckpointHeader loaded;
+    if (fread(&loaded, 1, sizeof(CheckpointHeader), file) !=
+        sizeof(CheckpointHeader))
+    {
+        exit(EXIT_FAILURE);
+    }
+    header->n_samples = loaded.n_samples;
+    if (memcmp(&loaded, header, sizeof(CheckpointHeader)) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    const usize n_pixels =
+        static_cast<usize>(header->config.width) * header->config.height;
+    if (fread(accumulation, sizeof(PixelStats), n_pixels, file) != n_pixels) {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return true;
+}
+
+// NOTE: Written aside and renamed over `path` once it is on disk, so a job
+// killed mid-write still finds the previous checkpoint intact.
+static void save_checkpoint(const char*             path,
+                            const CheckpointHeader* header,
+                            const PixelStats*       accumulation) {
+    char temp[CHECKPOINT_PATH];
+    if (CHECKPOINT_PATH <=
+        static_cast<usize>(snprintf(temp, sizeof(temp), "%s.tmp", path)))
+    {
+        exit(EXIT_FAILURE);
+    }
+    File* file = fopen(temp, "wb");
+    if (!file) {
+        exit(EXIT_FAILURE);
+    }
+    const usize n_pixels =
+        static_cast<usize>(header->config.width) * header->config.height;
+    if ((fwrite(header, 1, sizeof(CheckpointHeader), file) !=
+         sizeof(CheckpointHeader)) ||
+        (fwrite(accumulation, sizeof(PixelStats), n_pixels, file) !=
+         n_pixels) ||
+        (fflush(file) != 0) || (fsync(fileno(file)) != 0))
+    {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    if (rename(temp, path) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static u32 get_rendered(const Pool* pool) {
+    u32 n_blocks = 0;
+    for (u32 i = 0; i < pool->n_threads; ++i) {
+        n_blocks += pool->workers[i].n_blocks;
+    }
+    return n_blocks;
+}
+
+// NOTE: Returns whether every block in range was rendered before
+// `deadline`.
+static bool set_pixels(Frame*          frame,
+                       Pool*           pool,
+                       const Camera*   camera,
+                       const Scene*    scene,
+                       const Sampling* sampling,
+                       const Kernel*   kernel,
+                       u64             deadline,
+                       bool            wavefront,
+                       BmpImage*       previous) {
+    const u32 first = frame->first_block;
+    const u32 n_blocks = frame->last_block - first;
+    const u32 n_threads = pool->n_threads;
+    for (u32 i = 0; i < n_threads; ++i) {
+        pool->deques[i].range.store(
+            get_range(first + ((i * n_blocks) / n_threads),
+                      first + (((i + 1) * n_blocks) / n_threads)),
+            RELAXED);
+        pool->wavefronts[i].stats = &frame->stats[i * frame->block_pixels];
+        pool->wavefronts[i].launched =
+            &frame->launched[i * frame->block_pixels];
+        pool->wavefronts[i].aovs =
+            frame->aov_tiles ? &frame->aov_tiles[i * frame->block_pixels]
+                             : null;
+    }
+    for (u32 i = 0; i < frame->y_blocks; ++i) {
+        frame->bands[i].store(0, RELAXED);
+    }
+    const Payload payload = {
+        frame,
+        camera,
+        scene,
+        sampling,
+        kernel,
+        deadline,
+        wavefront,
+        WORK_RENDER,
+    };
+    const u32 n_rendered = get_rendered(pool);
+    run_pool(pool, &payload, previous);
+    return (get_rendered(pool) - n_rendered) == n_blocks;
+}
+
+// NOTE: Runs once all samples are in, over the whole of `accumulation`, and
+// overwrites the image `set_pixels` left behind.
+static void denoise_frame(Frame* frame, Pool* pool) {
+    const Payload payload = {
+        frame,
+        null,
+        null,
+        null,
+        null,
+        NO_DEADLINE,
+        false,
+        WORK_DENOISE,
+    };
+    run_pool(pool, &payload, null);
+}
+
+// NOTE: Has the workers zero the frame's buffers, each its own share, before
+// anything else writes them; also how an animation clears `accumulation`
+// and `aovs` between frames.
+static void touch_frame(Frame* frame, Pool* pool) {
+    const Payload payload = {
+        frame,
+        null,
+        null,
+        null,
+        null,
+        NO_DEADLINE,
+        false,
+        WORK_TOUCH,
+    };
+    run_pool(pool, &payload, null);
+}
+
+// NOTE: Every frame shares the pool, scene and arena, which `touch_frame`
+// clears again before each frame after the first. While one renders the
+// main thread waits out the writeback of the one before and closes it;
+// `frame->image` is left open on the last frame, which the caller has
+// already opened as frame zero.
+static void render_sequence(Frame*          frame,
+                            Pool*           pool,
+                            const Config*   config,
+                            const Scene*    scene,
+                            const Sampling* sampling,
+                            const Kernel*   kernel,
+                            const Sequence* sequence,
+                            const char*     path,
+                            bool            wavefront) {
+    const f32 first = sequence->keys[0].time;
+    const f32 span = sequence->keys[sequence->n_keys - 1].time - first;
+    for (u32 i = 0; i < sequence->n_frames; ++i) {
+        const u64 start = get_nanoseconds();
+        BmpImage  previous = frame->image;
+        if (0 < i) {
+            char buffer[FRAME_PATH];
+            open_bmp(&frame->image,
+                     get_frame_path(buffer, path, i),
+                     config->width,
+                     config->height);
+        }
+        const f32 time =
+            1 < sequence->n_frames
+                ? first + ((span * static_cast<f32>(i)) /
+                           static_cast<f32>(sequence->n_frames - 1))
+                : first;
+        Config view = *config;
+        set_view(&view, sequence, time);
+        const Camera camera = get_camera(&view);
+        if (0 < i) {
+            touch_frame(frame, pool);
+        }
+        set_pixels(frame,
+                   pool,
+                   &camera,
+                   scene,
+                   sampling,
+                   kernel,
+                   NO_DEADLINE,
+                   wavefront,
+                   0 < i ? &previous : null);
+        if (frame->planes) {
+            denoise_frame(frame, pool);
+        }
+        printf("Frame %-4u       : %8.2fms (t = %.3f)\n",
+               i,
+               static_cast<double>(get_nanoseconds() - start) / 1000000.0,
+               static_cast<double>(time));
+    }
+}
+
+// NOTE: Blocks `[first_block, first_block + n_blocks)` of the frame's Morton
+// order, where each pixel takes samples `[first_sample, first_sample +
+// n_samples)`; a zero count runs to the end of the frame. A job with no
+// blocks tells a farm worker to quit.
+struct Job {
+    u32 first_block;
+    u32 n_blocks;
+    u32 first_sample;
+    u32 n_samples;
+};
+
+// NOTE: Followed by one `PixelStats` per pixel of the job's blocks, block by
+// block and row-major within each, counting only the job's own samples.
+// `frame` describes the whole render, with `n_samples` set to its full
+// sample count, and has to match across every partial that is merged, as
+// does `adaptive`.
+struct PartialHeader {
+    u32              magic;
+    u32              version;
+    Job              job;
+    CheckpointHeader frame;
+    u32              adaptive;
+};
+
+struct Farm {
+    const Config*   config;
+    const Scene*    scene;
+    const Sampling* sampling;
+    const BmpImage* image;
+    u32             n_workers;
+    u32             n_threads;
+    u32             materials;
+    bool            wavefront;
+};
+
+struct FarmWorker {
+    i32   pid;
+    i32   jobs;
+    File* results;
+    bool  busy;
+};
+
+typedef struct pollfd PollFile;
+
+static void set_partial_header(PartialHeader*  header,
+                               const Config*   config,
+                               const Sampling* sampling,
+                               const Job*      job) {
+    memset(header, 0, sizeof(PartialHeader));
+    header->magic = PARTIAL_MAGIC;
+    header->version = PARTIAL_VERSION;
+    header->job = *job;
+    set_checkpoint_header(&header->frame, config, sampling);
+    header->frame.n_samples = sampling->max_samples;
+    header->adaptive = 0.0f < sampling->threshold;
+}
+
+// NOTE: Every pixel of the job's blocks starts out empty at `first_sample`;
+// streams are keyed by sample index, so the job renders exactly that slice
+// of what a single full render would have.
+static void render_job(Frame*          frame,
+                       Pool*           pool,
+                       const Config*   config,
+                       const Scene*    scene,
+                       const Sampling* sampling,
+                       const Job*      job,
+                       u32             materials,
+                       bool            wavefront) {
+    const u32 last = job->first_block + job->n_blocks;
+    for (u32 i = job->first_block; i < last; ++i) {
+        const Block block = frame->blocks[i];
+        for (u32 y = block.start.y; y < block.end.y; ++y) {
+            for (u32 x = block.start.x; x < block.end.x; ++x) {
+                PixelStats* stats =
+                    &frame->accumulation[x + (y * config->width)];
+                *stats = {};
+                stats->n = job->first_sample;
+            }
+        }
+    }
+    Sampling pass = *sampling;
+    pass.max_samples = job->first_sample + job->n_samples;
+    pass.min_samples = sampling->min_samples < pass.max_samples
+                           ? sampling->min_samples
+                           : pass.max_samples;
+    frame->first_block = job->first_block;
+    frame->last_block = last;
+    const Camera camera = get_camera(config);
+    set_pixels(frame,
+               pool,
+               &camera,
+               scene,
+               &pass,
+               get_kernel(&pass, materials, false),
+               NO_DEADLINE,
+               wavefront,
+               null);
+}
+
+static void write_partial(File*                file,
+                          const PartialHeader* header,
+                          const Frame*         frame) {
+    if (fwrite(header, 1, sizeof(PartialHeader), file) !=
+        sizeof(PartialHeader))
+    {
+        exit(EXIT_FAILURE);
+    }
+    const Job* job = &header->job;
+    const u32  width = header->frame.config.width;
+    for (u32 i = job->first_block; i < (job->first_block + job->n_blocks);
+         ++i)
+    {
+        const Block block = frame->blocks[i];
+        for (u32 y = block.start.y; y < block.end.y; ++y) {
+            for (u32 x = block.start.x; x < block.end.x; ++x) {
+                PixelStats stats = frame->accumulation[x + (y * width)];
+                stats.n -= job->first_sample;
+                if (fwrite(&stats, sizeof(PixelStats), 1, file) != 1) {
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    if (fflush(file) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void read_partial_header(File* file, PartialHeader* header) {
+    if ((fread(header, 1, sizeof(PartialHeader), file) !=
+         sizeof(PartialHeader)) ||
+        (header->magic != PARTIAL_MAGIC) ||
+        (header->version != PARTIAL_VERSION))
+    {
+        exit(EXIT_FAILURE);
+    }
+    const Config* config = &header->frame.config;
+    if ((config->width == 0) || (IMAGE_MAX < config->width) ||
+        (config->height == 0) || (IMAGE_MAX < config->height) ||
+        (config->block_width == 0) || (config->width < config->block_width) ||
+        (config->block_height == 0) ||
+        (config->height < config->block_height))
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// NOTE: Adds the partial's sums and counts into `frame->accumulation`; its
+// header has already been read and checked against the frame.
+static void read_partial(File*                file,
+                         const PartialHeader* header,
+                         Frame*               frame) {
+    const Job* job = &header->job;
+    const u32  width = header->frame.config.width;
+    if ((frame->n_blocks < job->first_block) ||
+        ((frame->n_blocks - job->first_block) < job->n_blocks))
+    {
+        exit(EXIT_FAILURE);
+    }
+    for (u32 i = job->first_block; i < (job->first_block + job->n_blocks);
+         ++i)
+    {
+        const Block block = frame->blocks[i];
+        for (u32 y = block.start.y; y < block.end.y; ++y) {
+            for (u32 x = block.start.x; x < block.end.x; ++x) {
+                PixelStats stats;
+                if (fread(&stats, sizeof(PixelStats), 1, file) != 1) {
+                    exit(EXIT_FAILURE);
+                }
+                PixelStats* merged = &frame->accumulation[x + (y * width)];
+                merged->sum += stats.sum;
+                merged->n += stats.n;
+            }
+        }
+    }
+}
+
+// NOTE: Fails unless every pixel got exactly `n_samples` samples, or
+// between one and `n_samples` for an adaptive render, which catches
+// partials that are missing or were merged twice.
+static void write_pixels(Frame* frame, u32 n_samples, bool adaptive) {
+    u64 n_merged = 0;
+    for (u32 y = 0; y < frame->image.height; ++y) {
+        Pixel*            row = get_row(&frame->image, y);
+        const PixelStats* stats = &frame->accumulation[y * frame->image.width];
+        for (u32 x = 0; x < frame->image.width; ++x) {
+            if ((stats[x].n == 0) || (n_samples < stats[x].n) ||
+                (!adaptive && (stats[x].n != n_samples)))
+            {
+                exit(EXIT_FAILURE);
+            }
+            set_pixel(&row[x], &stats[x]);
+            n_merged += stats[x].n;
+        }
+    }
+    N_SAMPLES.fetch_add(n_merged, SEQ_CST);
+}
+
+// NOTE: The first partial fixes the frame that every other one has to
+// match. Only the accumulation and block list are needed, so the frame is
+// laid out for no threads at all.
+static void merge_partials(const char* const* paths,
+                           u32                n_paths,
+                           const char*        path) {
+    PartialHeader first = {};
+    Frame         frame;
+    Arena         arena = {};
+    for (u32 i = 0; i < n_paths; ++i) {
+        File* file = fopen(paths[i], "rb");
+        if (!file) {
+            exit(EXIT_FAILURE);
+        }
+        PartialHeader header;
+        read_partial_header(file, &header);
+        if (i == 0) {
+            first = header;
+            arena.size = get_frame_size(&first.frame.config, 0, true, false);
+            arena.buffer = reinterpret_cast<u8*>(alloc(arena.size));
+            set_frame(&frame, &arena, &first.frame.config, 0, true, false);
+        } else if ((memcmp(&header.frame,
+                           &first.frame,
+                           sizeof(CheckpointHeader)) != 0) ||
+                   (header.adaptive != first.adaptive))
+        {
+            exit(EXIT_FAILURE);
+        }
+        read_partial(file, &header, &frame);
+        fclose(file);
+    }
+    open_bmp(&frame.image,
+             path,
+             first.frame.config.width,
+             first.frame.config.height);
+    write_pixels(&frame, first.frame.n_samples, first.adaptive != 0);
+    close_bmp(&frame.image);
+    munmap(arena.buffer, arena.size);
+}
+
+// NOTE: Each worker gets its own slice of the CPUs this process may run on,
+// or a single one once there are more workers than CPUs, so the pools of
+// different workers never pin threads to the same core.
+static void set_worker_cpus(u32 worker, u32 n_workers) {
+    CpuSet set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    u32 cpus[CPU_SETSIZE];
+    u32 n_cpus = 0;
+    for (u32 i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set)) {
+            cpus[n_cpus++] = i;
+        }
+    }
+    if (n_cpus == 0) {
+        exit(EXIT_FAILURE);
+    }
+    const u32 first = (worker * n_cpus) / n_workers;
+    u32       last = ((worker + 1) * n_cpus) / n_workers;
+    last = first < last ? last : first + 1;
+    CPU_ZERO(&set);
+    for (u32 i = first; i < last; ++i) {
+        CPU_SET(cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// NOTE: Runs in a forked child, which starts a pool of its own. Jobs arrive
+// on `jobs` and each one goes back up `results` as a partial; blocks also
+// land straight in the image mapping shared with the coordinator.
+static void run_worker(const Farm* farm, u32 worker, i32 jobs, i32 results) {
+    set_worker_cpus(worker, farm->n_workers);
+    Pool pool;
+    start_pool(&pool, farm->n_threads);
+    Arena arena = {};
+    arena.size = get_frame_size(farm->config, pool.n_threads, true, false);
+    arena.buffer = reinterpret_cast<u8*>(alloc(arena.size));
+    Frame frame;
+    set_frame(&frame, &arena, farm->config, pool.n_threads, true, false);
+    frame.image = *farm->image;
+    File* file = fdopen(results, "wb");
+    if (!file) {
+        exit(EXIT_FAILURE);
+    }
+    PartialHeader header;
+    for (;;) {
+        Job job;
+        if (read(jobs, &job, sizeof(Job)) != sizeof(Job)) {
+            exit(EXIT_FAILURE);
+        }
+        if (job.n_blocks == 0) {
+            break;
+        }
+        render_job(&frame,
+                   &pool,
+                   farm->config,
+                   farm->scene,
+                   farm->sampling,
+                   &job,
+                   farm->materials,
+                   farm->wavefront);
+        set_partial_header(&header, farm->config, farm->sampling, &job);
+        write_partial(file, &header, &frame);
+    }
+    stop_pool(&pool);
+    fclose(file);
+    close(jobs);
+    _exit(EXIT_SUCCESS);
+}
+
+// NOTE: Jobs walk every run of `block_step` blocks for one chunk of
+// `sample_step` samples before moving on to the next chunk; once all
+// `n_jobs` are handed out only the empty job is left.
+static Job get_farm_job(const Frame*    frame,
+                        const Sampling* sampling,
+                        u32             block_step,
+                        u32             sample_step,
+                        u32             n_jobs,
+                        u32*            next) {
+    if (n_jobs <= *next) {
+        return {};
+    }
+    const u32 index = (*next)++;
+    const u32 x_jobs = (frame->n_blocks + block_step - 1) / block_step;
+    Job       job;
+    job.first_block = (index % x_jobs) * block_step;
+    job.n_blocks = frame->n_blocks - job.first_block;
+    job.n_blocks = job.n_blocks < block_step ? job.n_blocks : block_step;
+    job.first_sample = (index / x_jobs) * sample_step;
+    job.n_samples = sampling->max_samples - job.first_sample;
+    job.n_samples = job.n_samples < sample_step ? job.n_samples : sample_step;
+    return job;
+}
+
+static void send_job(FarmWorker* worker, const Job* job) {
+    if (write(worker->jobs, job, sizeof(Job)) != sizeof(Job)) {
+        exit(EXIT_FAILURE);
+    }
+    worker->busy = job->n_blocks != 0;
+}
+
+// NOTE: Forks `n_workers` processes before any thread exists and hands each
+// the next job as soon as its last partial has been merged, so faster
+// workers take on more of the frame. There are `FARM_JOBS` runs of blocks
+// per worker for every chunk of `pass_samples` samples (all of them when
+// zero). Pipes to and from a worker are single-writer, so a job is one
+// atomic write and a partial is never interleaved with another.
+static void run_farm(const Farm* farm, Frame* frame, u32 pass_samples) {
+    const Sampling* sampling = farm->sampling;
+    const u32       n_workers = farm->n_workers;
+    Arena           arena = {};
+    arena.size = get_frame_size(farm->config, 0, true, false);
+    arena.buffer = reinterpret_cast<u8*>(alloc(arena.size));
+    set_frame(frame, &arena, farm->config, 0, true, false);
+    u32 block_step = n_workers * FARM_JOBS;
+    block_step = (frame->n_blocks + block_step - 1) / block_step;
+    const u32 sample_step = (pass_samples != 0) &&
+                                    (pass_samples < sampling->max_samples)
+                                ? pass_samples
+                                : sampling->max_samples;
+    const u32 n_jobs =
+        ((frame->n_blocks + block_step - 1) / block_step) *
+        ((sampling->max_samples + sample_step - 1) / sample_step);
+    printf("Workers          : %u\n"
+           "Jobs             : %u (%u blocks, %u spp each)\n"
+           "\n",
+           n_workers,
+           n_jobs,
+           block_step,
+           sample_step);
+    fflush(stdout);
+    FarmWorker* workers =
+        reinterpret_cast<FarmWorker*>(alloc(sizeof(FarmWorker) * n_workers));
+    PollFile* polls =
+        reinterpret_cast<PollFile*>(alloc(sizeof(PollFile) * n_workers));
+    for (u32 i = 0; i < n_workers; ++i) {
+        i32 down[2];
+        i32 up[2];
+        if ((pipe(down) != 0) || (pipe(up) != 0)) {
+            exit(EXIT_FAILURE);
+        }
+        const i32 pid = fork();
+        if (pid < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            for (u32 j = 0; j < i; ++j) {
+                close(workers[j].jobs);
+                fclose(workers[j].results);
+            }
+            close(down[1]);
+            close(up[0]);
+            run_worker(farm, i, down[0], up[1]);
+        }
+        close(down[0]);
+        close(up[1]);
+        workers[i] = {pid, down[1], fdopen(up[0], "rb"), false};
+        if (!workers[i].results) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    u32 next = 0;
+    for (u32 i = 0; i < n_workers; ++i) {
+        const Job job = get_farm_job(
+            frame, sampling, block_step, sample_step, n_jobs, &next);
+        send_job(&workers[i], &job);
+    }
+    const Job     none = {};
+    PartialHeader expected;
+    set_partial_header(&expected, farm->config, sampling, &none);
+    for (u32 n_merged = 0; n_merged < n_jobs;) {
+        for (u32 i = 0; i < n_workers; ++i) {
+            polls[i] = {
+                workers[i].busy ? fileno(workers[i].results) : -1,
+                POLLIN,
+                0,
+            };
+        }
+        if (poll(polls, n_workers, -1) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        for (u32 i = 0; i < n_workers; ++i) {
+            if (polls[i].revents == 0) {
+                continue;
+            }
+            PartialHeader header;
+            read_partial_header(workers[i].results, &header);
+            if ((memcmp(&header.frame,
+                        &expected.frame,
+                        sizeof(CheckpointHeader)) != 0) ||
+                (header.adaptive != expected.adaptive))
+            {
+                exit(EXIT_FAILURE);
+            }
+            read_partial(workers[i].results, &header, frame);
+            ++n_merged;
+            const Job job = get_farm_job(
+                frame, sampling, block_step, sample_step, n_jobs, &next);
+            send_job(&workers[i], &job);
+        }
+    }
+    for (u32 i = 0; i < n_workers; ++i) {
+        i32 status;
+        if ((waitpid(workers[i].pid, &status, 0) != workers[i].pid) ||
+            !WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS))
+        {
+            exit(EXIT_FAILURE);
+        }
+        fclose(workers[i].results);
+        close(workers[i].jobs);
+    }
+    write_pixels(frame, sampling->max_samples, 0.0f < sampling->threshold);
+    munmap(workers, sizeof(FarmWorker) * n_workers);
+    munmap(polls, sizeof(PollFile) * n_workers);
+    munmap(arena.buffer, arena.size);
+}
+
+static void get_sample_range(const Frame* frame, u32* min, u32* max) {
+    const usize n_pixels =
+        static_cast<usize>(frame->image.width) * frame->image.height;
+    *min = frame->accumulation[0].n;
+    *max = frame->accumulation[0].n;
+    for (usize i = 1; i < n_pixels; ++i) {
+        const u32 n = frame->accumulation[i].n;
+        *min = n < *min ? n : *min;
+        *max = *max < n ? n : *max;
+    }
+}
+
+// NOTE: A grayscale image of the samples each pixel got, scaled so that
+// `max` is white.
+static void write_sample_map(const char* path, const Frame* frame, u32 max) {
+    BmpImage map;
+    open_bmp(&map, path, frame->image.width, frame->image.height);
+    for (u32 y = 0; y < map.height; ++y) {
+        Pixel*            row = get_row(&map, y);
+        const PixelStats* stats = &frame->accumulation[y * map.width];
+        for (u32 x = 0; x < map.width; ++x) {
+            const u8 value = static_cast<u8>(
+                (static_cast<u64>(stats[x].n) * 255) / (max ? max : 1));
+            row[x] = {value, value, value};
+        }
+    }
+    close_bmp(&map);
+}
+
+// NOTE: Busy and idle times and block counts add up over every pass.
+static void print_pool(const Pool* pool) {
+    const u32 n_threads = pool->n_threads;
+    u64       finish = 0;
+    for (u32 i = 0; i < n_threads; ++i) {
+        if (finish < pool->workers[i].finish) {
+            finish = pool->workers[i].finish;
+        }
+    }
+    printf("Threads          : %u (%u sockets)\n", n_threads, pool->n_sockets);
+    for (u32 i = 0; i < n_threads; ++i) {
+        const Worker* worker = &pool->workers[i];
+        printf("Thread %-3u       : cpu %3u, %8.2fms busy, %8.2fms idle, "
+               "%4u blocks (%u stolen)\n",
+               i,
+               worker->cpu,
+               static_cast<double>(worker->busy) / 1000000.0,
+               static_cast<double>(finish - worker->busy) / 1000000.0,
+               worker->n_blocks,
+               worker->n_stolen);
+    }
+    printf("\n");
+}
+
+static void get_counters(const Pool* pool, Counters* counters) {
+    *counters = {};
+    for (u32 i = 0; i < pool->n_threads; ++i) {
+        const Counters* worker = &pool->workers[i].counters;
+        counters->n_rays += worker->n_rays;
+        counters->n_bounces += worker->n_bounces;
+        counters->n_roulette += worker->n_roulette;
+        counters->n_primary += worker->n_primary;
+        counters->n_nodes += worker->n_nodes;
+        counters->n_tests += worker->n_tests;
+        counters->n_absorbed += worker->n_absorbed;
+        counters->n_exhausted += worker->n_exhausted;
+        counters->n_shadows += worker->n_shadows;
+        counters->n_occluded += worker->n_occluded;
+        for (u32 j = 0; j < N_MATERIALS; ++j) {
+            counters->n_scatters[j] += worker->n_scatters[j];
+        }
+        for (u32 j = 0; j < COUNTER_DEPTHS; ++j) {
+            counters->depths[j] += worker->depths[j];
+        }
+    }
+}
+
+#if COUNTERS
+static void print_counters(const Counters* counters) {
+    const double n_rays = static_cast<double>(counters->n_rays);
+    printf("Rays             : %lu (%lu primary, %lu secondary)\n"
+           "Hits             : %lu (%.2f%% of rays)\n"
+           "BVH nodes        : %lu (%.2f/ray)\n"
+           "Sphere tests     : %lu (%.2f/ray)\n"
+           "Scatters         : %lu lambertian, %lu metal, %lu dielectric\n"
+           "Emitters         : %lu\n"
+           "Shadow rays      : %lu (%lu occluded)\n"
+           "Absorbed         : %lu\n"
+           "Exhausted        : %lu\n",
+           counters->n_rays,
+           counters->n_primary,
+           counters->n_rays - counters->n_primary,
+           counters->n_bounces,
+           (100.0 * static_cast<double>(counters->n_bounces)) / n_rays,
+           counters->n_nodes,
+           static_cast<double>(counters->n_nodes) / n_rays,
+           counters->n_tests,
+           static_cast<double>(counters->n_tests) / n_rays,
+           counters->n_scatters[LAMBERTIAN],
+           counters->n_scatters[METAL],
+           counters->n_scatters[DIELECTRIC],
+           counters->n_scatters[EMISSIVE],
+           counters->n_shadows,
+           counters->n_occluded,
+           counters->n_absorbed,
+           counters->n_exhausted);
+    for (u32 i = 0; i < COUNTER_DEPTHS; ++i) {
+        if (counters->depths[i] == 0) {
+            continue;
+        }
+        printf("Depth %2u%c        : %lu (%.2f%%)\n",
+               i,
+               (i + 1) == COUNTER_DEPTHS ? '+' : ' ',
+               counters->depths[i],
+               (100.0 * static_cast<double>(counters->depths[i])) /
+                   static_cast<double>(counters->n_primary));
+    }
+    printf("\n");
+}
+
+static void write_counters(File* file, const Counters* counters) {
+    fprintf(file,
+            ",\n"
+            "    \"counters\": {\n"
+            "        \"rays\": %lu,\n"
+            "        \"primary_rays\": %lu,\n"
+            "        \"hits\": %lu,\n"
+            "        \"bvh_nodes\": %lu,\n"
+            "        \"sphere_tests\": %lu,\n"
+            "        \"scatters\": {\n"
+            "            \"lambertian\": %lu,\n"
+            "            \"metal\": %lu,\n"
+            "            \"dielectric\": %lu,\n"
+            "            \"emissive\": %lu\n"
+            "        },\n"
+            "        \"shadow_rays\": %lu,\n"
+            "        \"occluded\": %lu,\n"
+            "        \"absorbed\": %lu,\n"
+            "        \"roulette\": %lu,\n"
+            "        \"exhausted\": %lu,\n"
+            "        \"depths\": [",
+            counters->n_rays,
+            counters->n_primary,
+            counters->n_bounces,
+            counters->n_nodes,
+            counters->n_tests,
+            counters->n_scatters[LAMBERTIAN],
+            counters->n_scatters[METAL],
+            counters->n_scatters[DIELECTRIC],
+            counters->n_scatters[EMISSIVE],
+            counters->n_shadows,
+            counters->n_occluded,
+            counters->n_absorbed,
+            counters->n_roulette,
+            counters->n_exhausted);
+    for (u32 i = 0; i < COUNTER_DEPTHS; ++i) {
+        fprintf(file, i == 0 ? "%lu" : ", %lu", counters->depths[i]);
+    }
+    fprintf(file, "]\n    }");
+}
+#endif
+
+static f32 get_linear(u8 x) {
+    const f32 value = static_cast<f32>(x) / RGB_COLOR_SCALE;
+    return value * value;
+}
+
+// NOTE: Undoes the `sqrtf` gamma of `set_pixel` first, so the error is
+// measured on the same linear values the samples were averaged in.
+static double get_rmse(BmpImage* image, BmpImage* reference) {
+    if ((image->width != reference->width) ||
+        (image->height != reference->height))
+    {
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0.0;
+    for (u32 y = 0; y < image->height; ++y) {
+        const Pixel* row = get_row(image, y);
+        const Pixel* expected = get_row(reference, y);
+        for (u32 x = 0; x < image->width; ++x) {
+            const f32 blue =
+                get_linear(row[x].blue) - get_linear(expected[x].blue);
+            const f32 green =
+                get_linear(row[x].green) - get_linear(expected[x].green);
+            const f32 red =
+                get_linear(row[x].red) - get_linear(expected[x].red);
+            sum += static_cast<double>((blue * blue) + (green * green) +
+                                       (red * red));
+        }
+    }
+    return sqrt(sum / (3.0 * image->width * image->height));
+}
+
+struct Timings {
+    u64 load;
+    u64 setup;
+    u64 render;
+    u64 denoise;
+    u64 write;
+};
+
+static i32 compare_u64(const void* a, const void* b) {
+    const u64 x = *reinterpret_cast<const u64*>(a);
+    const u64 y = *reinterpret_cast<const u64*>(b);
+    return x < y ? -1 : y < x ? 1 : 0;
+}
+
+static double get_milliseconds(u64 nanoseconds) {
+    return static_cast<double>(nanoseconds) / 1000000.0;
+}
+
+// NOTE: Sorts `block_times` in place; only called once rendering is done.
+static void write_json(const char*     path,
+                       const char*     scene_path,
+                       Frame*          frame,
+                       const Pool*     pool,
+                       const Counters* counters,
+                       const Sampling* sampling,
+                       const Timings*  timings,
+                       double          rmse,
+                       bool            wavefront) {
+    File* file = fopen(path, "w");
+    if (!file) {
+        exit(EXIT_FAILURE);
+    }
+    qsort(frame->block_times, frame->n_blocks, sizeof(u64), compare_u64);
+    const u64 n_rays = counters->n_rays;
+    const u64 n_samples = N_SAMPLES.load(SEQ_CST);
+    const double seconds = static_cast<double>(timings->render) / 1000000000.0;
+    fprintf(file,
+            "{\n"
+            "    \"scene\": \"%s\",\n"
+            "    \"renderer\": \"%s\",\n"
+            "    \"sampler\": \"%s\",\n"
+            "    \"width\": %u,\n"
+            "    \"height\": %u,\n"
+            "    \"seed\": %lu,\n"
+            "    \"spp\": %u,\n"
+            "    \"bounces\": %u,\n"
+            "    \"threads\": %u,\n"
+            "    \"rays\": %lu,\n"
+            "    \"samples\": %lu,\n"
+            "    \"mrays_per_second\": %.3f,\n"
+            "    \"samples_per_second\": %.1f,\n"
+            "    \"phases_ms\": {\n"
+            "        \"load\": %.3f,\n"
+            "        \"setup\": %.3f,\n"
+            "        \"render\": %.3f,\n"
+            "        \"denoise\": %.3f,\n"
+            "        \"write\": %.3f\n"
+            "    },\n"
+            "    \"tile_ms\": {\n"
+            "        \"p50\": %.3f,\n"
+            "        \"p99\": %.3f\n"
+            "    }",
+            scene_path ? scene_path : "default",
+            wavefront ? "wavefront" : "megakernel",
+            SAMPLERS[sampling->sampler],
+            frame->image.width,
+            frame->image.height,
+            sampling->seed,
+            sampling->max_samples,
+            sampling->n_bounces,
+            pool->n_threads,
+            n_rays,
+            n_samples,
+            (static_cast<double>(n_rays) / seconds) / 1000000.0,
+            static_cast<double>(n_samples) / seconds,
+            get_milliseconds(timings->load),
+            get_milliseconds(timings->setup),
+            get_milliseconds(timings->render),
+            get_milliseconds(timings->denoise),
+            get_milliseconds(timings->write),
+            get_milliseconds(
+                frame->block_times[((frame->n_blocks - 1) * 50) / 100]),
+            get_milliseconds(
+                frame->block_times[((frame->n_blocks - 1) * 99) / 100]));
+    if (0.0 <= rmse) {
+        fprintf(file, ",\n    \"rmse\": %.6f", rmse);
+    }
+#if COUNTERS
+    write_counters(file, counters);
+#endif
+    fprintf(file, "\n}\n");
+    fclose(file);
+}
+
+static Vec3 get_vec3(const char** args) {
+    return {
+        strtof(args[0], null),
+        strtof(args[1], null),
+        strtof(args[2], null),
+    };
+}
+
+i32 main(i32 n, const char** args) {
+    const u64 start = get_nanoseconds();
+    printf("sizeof(void*)    : %zu\n"
+           "sizeof(Vec3)     : %zu\n"
+           "sizeof(RgbColor) : %zu\n"
+           "sizeof(Material) : %zu\n"
+           "sizeof(Features) : %zu\n"
+           "sizeof(Hit)      : %zu\n"
+           "sizeof(Sphere)   : %zu\n"
+           "sizeof(Surface)  : %zu\n"
+           "sizeof(Camera)   : %zu\n"
            "sizeof(Ray)      : %zu\n"
            "sizeof(Point)    : %zu\n"
            "sizeof(Block)    : %zu\n"
+           "sizeof(Deque)    : %zu\n"
            "sizeof(Payload)  : %zu\n"
-           "sizeof(Memory)   : %zu\n"
+           "sizeof(BvhNode)  : %zu\n"
+           "sizeof(Wavefront): %zu\n"
+           "sizeof(Frame)    : %zu\n"
            "\n",
            sizeof(void*),
            sizeof(Vec3),
@@ -428,25 +3460,469 @@ i32 main(i32 n, const char** args) {
            sizeof(Features),
            sizeof(Hit),
            sizeof(Sphere),
+           sizeof(Surface),
            sizeof(Camera),
            sizeof(Ray),
            sizeof(Point),
            sizeof(Block),
+           sizeof(Deque),
            sizeof(Payload),
-           sizeof(Memory));
-    if (n < 2) {
-        exit(EXIT_FAILURE);
+           sizeof(BvhNode),
+           sizeof(Wavefront),
+           sizeof(Frame));
+    const char*  path = null;
+    const char*  scene_path = null;
+    const char*  checkpoint_path = null;
+    f32          checkpoint_interval = CHECKPOINT_INTERVAL;
+    const char*  sample_map_path = null;
+    const char*  json_path = null;
+    const char*  reference_path = null;
+    const char*  partial_path = null;
+    const char** merge_paths = null;
+    u32          n_merges = 0;
+    Job          job = {};
+    bool         ranged = false;
+    i32          n_workers = 0;
+    const char*  keys_path = null;
+    Sequence     sequence = {};
+    u32          pass_samples = 0;
+    f32          budget = 0.0f;
+    const char*  text_path = null;
+    bool         wavefront = false;
+    bool         denoise = false;
+    i32          n_threads = 0;
+    Config       config = {
+        IMAGE_WIDTH,
+        IMAGE_HEIGHT,
+        BLOCK_WIDTH,
+        BLOCK_HEIGHT,
+        VERTICAL_FOV,
+        APERTURE,
+        LOOK_FROM,
+        LOOK_AT,
+        UP,
+    };
+    Sampling sampling = {
+        0,
+        0.0f,
+        0,
+        SAMPLES_PER_PIXEL,
+        N_BOUNCES,
+        ROULETTE_DEPTH,
+        0,
+        SAMPLER_RANDOM,
+    };
+    for (i32 i = 1; i < n; ++i) {
+        if (!strcmp(args[i], "--wavefront")) {
+            wavefront = true;
+        } else if (!strcmp(args[i], "--denoise")) {
+            denoise = true;
+        } else if (!strcmp(args[i], "--scene") && ((i + 1) < n)) {
+            scene_path = args[++i];
+        } else if (!strcmp(args[i], "--convert") && ((i + 2) < n)) {
+            text_path = args[++i];
+            scene_path = args[++i];
+        } else if (!strcmp(args[i], "--threads") && ((i + 1) < n)) {
+            n_threads = atoi(args[++i]);
+        } else if (!strcmp(args[i], "--seed") && ((i + 1) < n)) {
+            sampling.seed = strtoull(args[++i], null, 10);
+        } else if (!strcmp(args[i], "--adaptive") && ((i + 1) < n)) {
+            sampling.threshold = strtof(args[++i], null);
+        } else if (!strcmp(args[i], "--min-spp") && ((i + 1) < n)) {
+            sampling.min_samples = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--max-spp") && ((i + 1) < n)) {
+            sampling.max_samples = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--checkpoint") && ((i + 1) < n)) {
+            checkpoint_path = args[++i];
+        } else if (!strcmp(args[i], "--checkpoint-interval") &&
+                   ((i + 1) < n))
+        {
+            checkpoint_interval = strtof(args[++i], null);
+        } else if (!strcmp(args[i], "--budget") && ((i + 1) < n)) {
+            budget = strtof(args[++i], null);
+        } else if (!strcmp(args[i], "--json") && ((i + 1) < n)) {
+            json_path = args[++i];
+        } else if (!strcmp(args[i], "--sampler") && ((i + 1) < n)) {
+            const char* name = args[++i];
+            u32         j = 0;
+            while ((j < N_SAMPLERS) && (strcmp(name, SAMPLERS[j]) != 0)) {
+                ++j;
+            }
+            if (j == N_SAMPLERS) {
+                exit(EXIT_FAILURE);
+            }
+            sampling.sampler = static_cast<Sampler>(j);
+        } else if (!strcmp(args[i], "--reference") && ((i + 1) < n)) {
+            reference_path = args[++i];
+        } else if (!strcmp(args[i], "--partial") && ((i + 1) < n)) {
+            partial_path = args[++i];
+        } else if (!strcmp(args[i], "--blocks") && ((i + 2) < n)) {
+            job.first_block = static_cast<u32>(atoi(args[++i]));
+            job.n_blocks = static_cast<u32>(atoi(args[++i]));
+            ranged = true;
+        } else if (!strcmp(args[i], "--samples") && ((i + 2) < n)) {
+            job.first_sample = static_cast<u32>(atoi(args[++i]));
+            job.n_samples = static_cast<u32>(atoi(args[++i]));
+            ranged = true;
+        } else if (!strcmp(args[i], "--merge") && ((i + 1) < n)) {
+            if (!merge_paths) {
+                merge_paths = reinterpret_cast<const char**>(
+                    alloc(sizeof(const char*) * static_cast<usize>(n)));
+            }
+            merge_paths[n_merges++] = args[++i];
+        } else if (!strcmp(args[i], "--farm") && ((i + 1) < n)) {
+            n_workers = atoi(args[++i]);
+        } else if (!strcmp(args[i], "--animate") && ((i + 2) < n)) {
+            keys_path = args[++i];
+            sequence.n_frames = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--spp-map") && ((i + 1) < n)) {
+            sample_map_path = args[++i];
+        } else if (!strcmp(args[i], "--pass-spp") && ((i + 1) < n)) {
+            pass_samples = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--roulette-depth") && ((i + 1) < n)) {
+            sampling.roulette_depth = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--spp") && ((i + 1) < n)) {
+            sampling.max_samples = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--preview")) {
+            sampling.max_samples = PREVIEW_SAMPLES;
+            sampling.n_bounces = PREVIEW_BOUNCES;
+        } else if (!strcmp(args[i], "--bounces") && ((i + 1) < n)) {
+            sampling.n_bounces = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--width") && ((i + 1) < n)) {
+            config.width = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--height") && ((i + 1) < n)) {
+            config.height = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--block-width") && ((i + 1) < n)) {
+            config.block_width = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--block-height") && ((i + 1) < n)) {
+            config.block_height = static_cast<u32>(atoi(args[++i]));
+        } else if (!strcmp(args[i], "--fov") && ((i + 1) < n)) {
+            config.vertical_fov = strtof(args[++i], null);
+        } else if (!strcmp(args[i], "--aperture") && ((i + 1) < n)) {
+            config.aperture = strtof(args[++i], null);
+        } else if (!strcmp(args[i], "--look-from") && ((i + 3) < n)) {
+            config.look_from = get_vec3(&args[i + 1]);
+            i += 3;
+        } else if (!strcmp(args[i], "--look-at") && ((i + 3) < n)) {
+            config.look_at = get_vec3(&args[i + 1]);
+            i += 3;
+        } else if (!strcmp(args[i], "--up") && ((i + 3) < n)) {
+            config.up = get_vec3(&args[i + 1]);
+            i += 3;
+        } else if (!path) {
+            path = args[i];
+        } else {
+            exit(EXIT_FAILURE);
+        }
     }
-    File* file = fopen(args[1], "wb");
-    if (!file) {
+    if (text_path) {
+        convert_scene(text_path, scene_path);
+        printf("Converted!\n");
+        return EXIT_SUCCESS;
+    }
+    if (n_merges != 0) {
+        if ((!path) || denoise) {
+            exit(EXIT_FAILURE);
+        }
+        merge_partials(merge_paths, n_merges, path);
+        printf("Merged!\n");
+        return EXIT_SUCCESS;
+    }
+    // NOTE: Without `--min-spp`, the minimum follows from the other flags once
+    // they are all in, so their order does not matter.
+    if (sampling.min_samples == 0) {
+        sampling.min_samples =
+            0.0f < sampling.threshold
+                ? (ADAPTIVE_MIN_SAMPLES < sampling.max_samples
+                       ? ADAPTIVE_MIN_SAMPLES
+                       : sampling.max_samples)
+                : sampling.max_samples;
+    }
+    if ((!path) || (n_threads < 0) || (sampling.max_samples == 0) ||
+        (sampling.max_samples < sampling.min_samples) ||
+        ((0.0f < sampling.threshold) && (sampling.min_samples < 2)) ||
+        (sampling.n_bounces == 0) || (config.width == 0) ||
+        (IMAGE_MAX < config.width) || (config.height == 0) ||
+        (IMAGE_MAX < config.height) || (config.block_width == 0) ||
+        (config.width < config.block_width) || (config.block_height == 0) ||
+        (config.height < config.block_height) ||
+        (config.vertical_fov <= 0.0f) || (180.0f <= config.vertical_fov) ||
+        (config.aperture < 0.0f) || (budget < 0.0f) || (n_workers < 0) ||
+        (ranged && !partial_path) || (partial_path && (n_workers != 0)) ||
+        ((partial_path || (n_workers != 0)) &&
+         (checkpoint_path || sample_map_path || json_path ||
+          (0.0f < budget))) ||
+        (partial_path && (pass_samples != 0)) ||
+        (denoise && (partial_path || (n_workers != 0) || checkpoint_path)) ||
+        ((0.0f < sampling.threshold) &&
+         ((job.first_sample != 0) || (job.n_samples != 0) ||
+          ((n_workers != 0) && (pass_samples != 0)))) ||
+        (sampling.max_samples <= job.first_sample) ||
+        ((sampling.max_samples - job.first_sample) < job.n_samples) ||
+        (keys_path &&
+         ((sequence.n_frames == 0) || partial_path || (n_workers != 0) ||
+          checkpoint_path || sample_map_path || reference_path ||
+          (pass_samples != 0) || (0.0f < budget))))
+    {
         exit(EXIT_FAILURE);
     }
-    Memory* memory = reinterpret_cast<Memory*>(alloc(sizeof(Memory)));
-    set_bmp_header(&memory->image.bmp_header);
-    set_dib_header(&memory->image.dib_header);
-    set_pixels(memory);
-    write_bmp(file, &memory->image);
-    fclose(file);
-    printf("Done!\n");
+    if (keys_path) {
+        read_keys(&sequence, keys_path);
+    }
+    if (job.n_samples == 0) {
+        job.n_samples = sampling.max_samples - job.first_sample;
+    }
+    while ((sampling.sampler == SAMPLER_BLUE) &&
+           (sampling.sample_bits < 31) &&
+           ((1u << sampling.sample_bits) < sampling.max_samples))
+    {
+        ++sampling.sample_bits;
+    }
+    u64 deadline = NO_DEADLINE;
+    if (0.0f < budget) {
+        deadline = start + static_cast<u64>(budget * 1000000.0f);
+        if (pass_samples == 0) {
+            pass_samples = 1;
+        }
+    }
+    Timings timings;
+    Frame   frame;
+    char    frame_path[FRAME_PATH];
+    open_bmp(&frame.image,
+             keys_path ? get_frame_path(frame_path, path, 0) : path,
+             config.width,
+             config.height);
+    u8* buffer = scene_path
+                     ? map_scene(scene_path)
+                     : build_scene(SPHERES, N_SPHERES, SURFACES, N_SURFACES);
+    Scene scene;
+    set_scene(&scene, buffer);
+    u64 phase = get_nanoseconds();
+    timings.load = phase - start;
+    if (n_workers != 0) {
+        const Farm farm = {
+            &config,
+            &scene,
+            &sampling,
+            &frame.image,
+            static_cast<u32>(n_workers),
+            static_cast<u32>(n_threads),
+            get_materials(&scene),
+            wavefront,
+        };
+        run_farm(&farm, &frame, pass_samples);
+        close_bmp(&frame.image);
+        printf("Samples/pixel    : %.2f\n"
+               "Elapsed          : %.2fms\n"
+               "\n"
+               "Done!\n",
+               static_cast<double>(N_SAMPLES.load(SEQ_CST)) /
+                   (static_cast<double>(config.width) * config.height),
+               static_cast<double>(get_nanoseconds() - start) / 1000000.0);
+        return EXIT_SUCCESS;
+    }
+    Pool pool;
+    start_pool(&pool, static_cast<u32>(n_threads));
+    // NOTE: The denoiser reads the per-pixel sums, so it needs them kept.
+    const bool accumulate = (checkpoint_path != null) ||
+                            (sample_map_path != null) ||
+                            (partial_path != null) || (pass_samples != 0) ||
+                            denoise;
+    Arena      arena = {};
+    arena.size = get_frame_size(&config, pool.n_threads, accumulate, denoise);
+    arena.buffer = reinterpret_cast<u8*>(alloc(arena.size));
+    set_frame(&frame, &arena, &config, pool.n_threads, accumulate, denoise);
+    touch_frame(&frame, &pool);
+    CheckpointHeader checkpoint;
+    set_checkpoint_header(&checkpoint, &config, &sampling);
+    if (checkpoint_path &&
+        load_checkpoint(checkpoint_path, &checkpoint, frame.accumulation))
+    {
+        printf("Resumed          : %u spp\n", checkpoint.n_samples);
+    }
+    const u32 materials = get_materials(&scene);
+    printf("Spheres          : %u\n"
+           "Resolution       : %ux%u\n"
+           "Sampler          : %s\n"
+           "Arena            : %.2fMB\n"
+           "\n",
+           scene.n_spheres,
+           config.width,
+           config.height,
+           SAMPLERS[sampling.sampler],
+           static_cast<double>(arena.size) / (1024.0 * 1024.0));
+    u64 saved = get_nanoseconds();
+    timings.setup = saved - phase;
+    phase = saved;
+    const Camera camera = get_camera(&config);
+    if (keys_path) {
+        const Kernel* kernel = get_kernel(&sampling, materials, false);
+        printf("Frames           : %u from %u keys, %s "
+               "(materials %#x of %#x)\n",
+               sequence.n_frames,
+               sequence.n_keys,
+               wavefront ? "wavefront" : kernel->name,
+               kernel->materials,
+               materials);
+        render_sequence(&frame,
+                        &pool,
+                        &config,
+                        &scene,
+                        &sampling,
+                        kernel,
+                        &sequence,
+                        path,
+                        wavefront);
+        printf("\n");
+    } else if (partial_path) {
+        if ((frame.n_blocks <= job.first_block) ||
+            ((frame.n_blocks - job.first_block) < job.n_blocks))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (job.n_blocks == 0) {
+            job.n_blocks = frame.n_blocks - job.first_block;
+        }
+        printf("Job              : blocks %u - %u of %u, samples %u - %u\n",
+               job.first_block,
+               job.first_block + job.n_blocks,
+               frame.n_blocks,
+               job.first_sample,
+               job.first_sample + job.n_samples);
+        render_job(&frame,
+                   &pool,
+                   &config,
+                   &scene,
+                   &sampling,
+                   &job,
+                   materials,
+                   wavefront);
+        PartialHeader header;
+        set_partial_header(&header, &config, &sampling, &job);
+        File* file = fopen(partial_path, "wb");
+        if (!file) {
+            exit(EXIT_FAILURE);
+        }
+        write_partial(file, &header, &frame);
+        fclose(file);
+    } else {
+        do {
+            u32 n_reached = sampling.max_samples;
+            if (sampling.max_samples <= checkpoint.n_samples) {
+                n_reached = checkpoint.n_samples;
+            } else if ((pass_samples != 0) &&
+                       ((checkpoint.n_samples + pass_samples) <
+                        sampling.max_samples))
+            {
+                n_reached = checkpoint.n_samples + pass_samples;
+            }
+            Sampling pass = sampling;
+            pass.min_samples = sampling.min_samples < n_reached
+                                   ? sampling.min_samples
+                                   : n_reached;
+            pass.max_samples = n_reached;
+            const Kernel* kernel =
+                get_kernel(&pass, materials, checkpoint_path != null);
+            printf("Pass             : %u of %u spp, %s "
+                   "(materials %#x of %#x)\n",
+                   n_reached,
+                   sampling.max_samples,
+                   wavefront ? "wavefront" : kernel->name,
+                   kernel->materials,
+                   materials);
+            // NOTE: The first pass always runs to completion, so a blown
+            // budget still leaves every pixel with samples.
+            const bool complete =
+                set_pixels(&frame,
+                           &pool,
+                           &camera,
+                           &scene,
+                           &pass,
+                           kernel,
+                           checkpoint.n_samples == 0 ? NO_DEADLINE : deadline,
+                           wavefront,
+                           null);
+            if (!complete) {
+                break;
+            }
+            checkpoint.n_samples = n_reached;
+            const f32 elapsed =
+                static_cast<f32>(get_nanoseconds() - saved) / 1000000000.0f;
+            if (checkpoint_path && ((sampling.max_samples <= n_reached) ||
+                                    (checkpoint_interval <= elapsed)))
+            {
+                save_checkpoint(checkpoint_path,
+                                &checkpoint,
+                                frame.accumulation);
+                saved = get_nanoseconds();
+            }
+        } while ((checkpoint.n_samples < sampling.max_samples) &&
+                 (get_nanoseconds() < deadline));
+    }
+    timings.render = get_nanoseconds() - phase;
+    phase = get_nanoseconds();
+    timings.denoise = 0;
+    if (denoise && !keys_path) {
+        denoise_frame(&frame, &pool);
+        timings.denoise = get_nanoseconds() - phase;
+        phase = get_nanoseconds();
+        printf("Denoise          : %.2fms\n",
+               get_milliseconds(timings.denoise));
+    }
+    stop_pool(&pool);
+    Counters counters;
+    get_counters(&pool, &counters);
+    print_pool(&pool);
+#if COUNTERS
+    print_counters(&counters);
+#endif
+    if (accumulate) {
+        u32 min;
+        u32 max;
+        get_sample_range(&frame, &min, &max);
+        printf("Samples range    : %u - %u\n", min, max);
+        if (sample_map_path) {
+            write_sample_map(sample_map_path, &frame, max);
+        }
+    }
+    double rmse = -1.0;
+    if (reference_path) {
+        BmpImage reference;
+        map_bmp(&reference, reference_path);
+        rmse = get_rmse(&frame.image, &reference);
+        close_bmp(&reference);
+        printf("RMSE             : %.6f\n", rmse);
+    }
+    close_bmp(&frame.image);
+    timings.write = get_nanoseconds() - phase;
+    if (json_path) {
+        write_json(json_path,
+                   scene_path,
+                   &frame,
+                   &pool,
+                   &counters,
+                   &sampling,
+                   &timings,
+                   rmse,
+                   wavefront);
+    }
+    munmap(arena.buffer, arena.size);
+    const u64 n_samples = N_SAMPLES.load(SEQ_CST);
+    printf("Samples/pixel    : %.2f\n"
+           "Bounces/path     : %.2f\n"
+           "Roulette         : %lu\n"
+           "Mrays/s          : %.2f\n"
+           "Elapsed          : %.2fms\n"
+           "\n"
+           "Done!\n",
+           static_cast<double>(n_samples) /
+               (static_cast<double>(config.width) * config.height *
+                (keys_path ? sequence.n_frames : 1)),
+           static_cast<double>(counters.n_bounces) /
+               static_cast<double>(n_samples),
+           counters.n_roulette,
+           static_cast<double>(counters.n_rays) /
+               (static_cast<double>(timings.render) / 1000.0),
+           static_cast<double>(get_nanoseconds() - start) / 1000000.0);
     return EXIT_SUCCESS;
 }
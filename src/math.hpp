@@ -3,7 +3,17 @@
 
 #define PI 3.1415926535897932385f
 
-static f32 degrees_to_radians(f32 degrees) {
+#define SIN_3  (-1.0f / 6.0f)
+#define SIN_5  (1.0f / 120.0f)
+#define SIN_7  (-1.0f / 5040.0f)
+#define SIN_9  (1.0f / 362880.0f)
+#define COS_2  (-1.0f / 2.0f)
+#define COS_4  (1.0f / 24.0f)
+#define COS_6  (-1.0f / 720.0f)
+#define COS_8  (1.0f / 40320.0f)
+#define COS_10 (-1.0f / 3628800.0f)
+
+static INLINE f32 degrees_to_radians(f32 degrees) {
     return (degrees * PI) / 180.0f;
 }
 
@@ -37,14 +47,6 @@ static Vec3 operator-(Vec3 a, Vec3 b) {
     };
 }
 
-static Vec3 operator-(Vec3 a, f32 b) {
-    return {
-        a.x - b,
-        a.y - b,
-        a.z - b,
-    };
-}
-
 static Vec3 operator*(Vec3 a, f32 b) {
     return {
         a.x * b,
@@ -61,6 +63,14 @@ static Vec3 operator*(f32 a, Vec3 b) {
     };
 }
 
+static Vec3 operator*(Vec3 a, Vec3 b) {
+    return {
+        a.x * b.x,
+        a.y * b.y,
+        a.z * b.z,
+    };
+}
+
 static Vec3 operator/(Vec3 a, f32 b) {
     return {
         a.x / b,
@@ -69,6 +79,22 @@ static Vec3 operator/(Vec3 a, f32 b) {
     };
 }
 
+static Vec3 min(Vec3 a, Vec3 b) {
+    return {
+        fminf(a.x, b.x),
+        fminf(a.y, b.y),
+        fminf(a.z, b.z),
+    };
+}
+
+static Vec3 max(Vec3 a, Vec3 b) {
+    return {
+        fmaxf(a.x, b.x),
+        fmaxf(a.y, b.y),
+        fmaxf(a.z, b.z),
+    };
+}
+
 static f32 dot(Vec3 a, Vec3 b) {
     return (a.x * b.x) + (a.y * b.y) + (a.z * b.z);
 }
@@ -81,7 +107,7 @@ static Vec3 unit(Vec3 a) {
     return a / len(a);
 }
 
-static Vec3 cross(Vec3 a, Vec3 b) {
+static INLINE Vec3 cross(Vec3 a, Vec3 b) {
     return {
         (a.y * b.z) - (a.z * b.y),
         (a.z * b.x) - (a.x * b.z),
@@ -106,6 +132,27 @@ static Vec3 refract(Vec3 uv, Vec3 n, f32 etai_over_etat) {
     return parallel + perpendicular;
 }
 
+// NOTE: Valid for `x` in `[-PI, PI]`; the half angle keeps both Taylor
+// series short, and the double-angle identities recover `sin(x)` and
+// `cos(x)` without a branch.
+static INLINE void get_sin_cos(f32 x, f32* sine, f32* cosine) {
+    const f32 h = x * 0.5f;
+    const f32 h2 = h * h;
+    f32       s = SIN_9;
+    s = SIN_7 + (h2 * s);
+    s = SIN_5 + (h2 * s);
+    s = SIN_3 + (h2 * s);
+    s = h * (1.0f + (h2 * s));
+    f32 c = COS_10;
+    c = COS_8 + (h2 * c);
+    c = COS_6 + (h2 * c);
+    c = COS_4 + (h2 * c);
+    c = COS_2 + (h2 * c);
+    c = 1.0f + (h2 * c);
+    *sine = 2.0f * s * c;
+    *cosine = 1.0f - (2.0f * s * s);
+}
+
 static f32 schlick(f32 cosine, f32 refreactive_index) {
     f32 r0 = (1.0f - refreactive_index) / (1.0f + refreactive_index);
     r0 *= r0;
@@ -0,0 +1,352 @@
+#include "prelude.hpp"
+
+#include "color.hpp"
+#include "math.hpp"
+#include "random.hpp"
+
+#include "bvh.hpp"
+#include "simd.hpp"
+
+#include "scene.hpp"
+
+#include "hit.hpp"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <x86intrin.h>
+
+#define MICRO_INPUTS  1024
+#define MICRO_OPS     (1 << 16)
+#define MICRO_WARMUP  16
+#define MICRO_TRIALS  64
+#define MICRO_SPHERES 16
+#define MICRO_Z       1.96
+
+static_assert((MICRO_INPUTS & (MICRO_INPUTS - 1)) == 0,
+              "MICRO_INPUTS is not a power of two");
+
+// NOTE: Inputs are drawn once up front and cycled through, so every op reads
+// warm, unpredictable data and nothing can be folded at compile time.
+struct Inputs {
+    Vec3 vectors[MICRO_INPUTS];
+    Vec3 normals[MICRO_INPUTS];
+    Ray  rays[MICRO_INPUTS];
+    f32  cosines[MICRO_INPUTS];
+    f32  t[MICRO_INPUTS];
+    u32  index[MICRO_INPUTS];
+    Rng  rngs[MICRO_INPUTS];
+};
+
+typedef void (*Bench)(const Scene*, const Inputs*, u32);
+
+struct Micro {
+    const char* name;
+    Bench       bench;
+};
+
+struct Trial {
+    u64 nanoseconds;
+    u64 ticks;
+    u64 cycles;
+};
+
+// NOTE: Forces `x` into a register without letting the compiler see a use,
+// so each op's result is kept but no dependency chain links consecutive ops.
+static INLINE void keep(f32 x) {
+    asm volatile("" : : "x"(x));
+}
+
+static INLINE void keep(u32 x) {
+    asm volatile("" : : "r"(x));
+}
+
+static INLINE void keep(Vec3 x) {
+    keep(x.x);
+    keep(x.y);
+    keep(x.z);
+}
+
+static INLINE void keep(f32x8 x) {
+    f32 lanes[SIMD_WIDTH];
+    store(lanes, x);
+    asm volatile("" : : "r"(lanes) : "memory");
+}
+
+static void bench_unit(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        keep(unit(inputs->vectors[i & (MICRO_INPUTS - 1)]));
+    }
+}
+
+static void bench_reflect(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u32 k = i & (MICRO_INPUTS - 1);
+        keep(reflect(inputs->vectors[k], inputs->normals[k]));
+    }
+}
+
+static void bench_refract(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u32 k = i & (MICRO_INPUTS - 1);
+        keep(refract(inputs->vectors[k], inputs->normals[k], 1.0f / 1.5f));
+    }
+}
+
+static void bench_schlick(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        keep(schlick(inputs->cosines[i & (MICRO_INPUTS - 1)], 1.5f));
+    }
+}
+
+static void bench_random_u32(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        Rng rng = inputs->rngs[i & (MICRO_INPUTS - 1)];
+        keep(get_random_u32(&rng));
+    }
+}
+
+static void bench_random_f32(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        Rng rng = inputs->rngs[i & (MICRO_INPUTS - 1)];
+        keep(get_random_f32(&rng));
+    }
+}
+
+// NOTE: One op draws a whole batch, eight times what `get_random_f32` draws.
+// The streams are copied once per trial rather than per op, since copying
+// eight of them would cost more than the draw; only their dimensions move.
+static void bench_random_f32x8(const Scene*, const Inputs* inputs, u32 n) {
+    static Rng rngs[MICRO_INPUTS];
+    memcpy(rngs, inputs->rngs, sizeof(rngs));
+    for (u32 i = 0; i < n; ++i) {
+        keep(get_random_f32x8(
+            &rngs[(i * SIMD_WIDTH) & (MICRO_INPUTS - 1)]));
+    }
+}
+
+static void bench_sequence_u32(const Scene*, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u32 k = i & (MICRO_INPUTS - 1);
+        keep(get_sequence_u32(inputs->rngs[k].key, k, i & 7u));
+    }
+}
+
+static void bench_get_nearest(const Scene*  scene,
+                              const Inputs* inputs,
+                              u32           n) {
+    for (u32 i = 0; i < n; ++i) {
+        f32 t = F32_MAX;
+        u32 index = scene->n_spheres;
+        get_nearest(scene,
+                    &inputs->rays[i & (MICRO_INPUTS - 1)],
+                    0,
+                    MICRO_SPHERES,
+                    &t,
+                    &index);
+        keep(t);
+        keep(index);
+    }
+}
+
+static void bench_is_blocked(const Scene*  scene,
+                             const Inputs* inputs,
+                             u32           n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u32 k = i & (MICRO_INPUTS - 1);
+        keep(static_cast<u32>(is_blocked(
+            scene, &inputs->rays[k], 0, MICRO_SPHERES, inputs->t[k])));
+    }
+}
+
+static void bench_set_hit(const Scene* scene, const Inputs* inputs, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u32 k = i & (MICRO_INPUTS - 1);
+        Hit       hit;
+        set_hit(scene, inputs->index[k], &inputs->rays[k], &hit, inputs->t[k]);
+        keep(hit.point);
+        keep(hit.normal);
+        keep(hit.surface->albedo.red);
+    }
+}
+
+static const Micro MICROS[] = {
+    {"unit", bench_unit},
+    {"reflect", bench_reflect},
+    {"refract", bench_refract},
+    {"schlick", bench_schlick},
+    {"get_random_u32", bench_random_u32},
+    {"get_random_f32", bench_random_f32},
+    {"get_random_f32x8", bench_random_f32x8},
+    {"get_sequence_u32", bench_sequence_u32},
+    {"get_nearest", bench_get_nearest},
+    {"is_blocked", bench_is_blocked},
+    {"set_hit", bench_set_hit},
+};
+
+#define N_MICROS (sizeof(MICROS) / sizeof(MICROS[0]))
+
+static u64 get_nanoseconds() {
+    TimeSpec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (static_cast<u64>(time.tv_sec) * 1000000000ul) +
+           static_cast<u64>(time.tv_nsec);
+}
+
+// NOTE: Returns -1 wherever perf is unavailable (containers, VMs,
+// `perf_event_paranoid`); the TSC is reported either way, but it ticks at a
+// fixed rate rather than in core cycles.
+static i32 open_cycles() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<i32>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static u64 read_cycles(i32 file) {
+    u64 cycles = 0;
+    if ((file < 0) || (read(file, &cycles, sizeof(cycles)) != sizeof(cycles)))
+    {
+        return 0;
+    }
+    return cycles;
+}
+
+static Trial run_trial(const Micro*  micro,
+                       const Scene*  scene,
+                       const Inputs* inputs,
+                       i32           cycles) {
+    const u64 cycles_start = read_cycles(cycles);
+    const u64 start = get_nanoseconds();
+    const u64 ticks_start = __rdtsc();
+    micro->bench(scene, inputs, MICRO_OPS);
+    const u64 ticks_end = __rdtsc();
+    const u64 end = get_nanoseconds();
+    return {
+        end - start,
+        ticks_end - ticks_start,
+        read_cycles(cycles) - cycles_start,
+    };
+}
+
+static double get_per_op(u64 x) {
+    return static_cast<double>(x) / static_cast<double>(MICRO_OPS);
+}
+
+// NOTE: Each trial times `MICRO_OPS` ops after `MICRO_WARMUP` untimed ones
+// have settled caches, branch predictors and clocks; the interval is the
+// normal approximation for the mean of `MICRO_TRIALS` trials.
+static void run_micro(const Micro*  micro,
+                      const Scene*  scene,
+                      const Inputs* inputs,
+                      i32           cycles) {
+    for (u32 i = 0; i < MICRO_WARMUP; ++i) {
+        run_trial(micro, scene, inputs, cycles);
+    }
+    Trial trials[MICRO_TRIALS];
+    for (u32 i = 0; i < MICRO_TRIALS; ++i) {
+        trials[i] = run_trial(micro, scene, inputs, cycles);
+    }
+    double sum = 0.0;
+    double min = DBL_MAX;
+    double ticks = 0.0;
+    double core_cycles = 0.0;
+    for (u32 i = 0; i < MICRO_TRIALS; ++i) {
+        const double x = get_per_op(trials[i].nanoseconds);
+        sum += x;
+        min = x < min ? x : min;
+        ticks += get_per_op(trials[i].ticks);
+        core_cycles += get_per_op(trials[i].cycles);
+    }
+    const double mean = sum / MICRO_TRIALS;
+    double       variance = 0.0;
+    for (u32 i = 0; i < MICRO_TRIALS; ++i) {
+        const double delta = get_per_op(trials[i].nanoseconds) - mean;
+        variance += delta * delta;
+    }
+    variance /= MICRO_TRIALS - 1;
+    printf("%-16s : %7.3f ns/op +/- %.3f (min %7.3f), %7.2f ticks/op",
+           micro->name,
+           mean,
+           MICRO_Z * sqrt(variance / MICRO_TRIALS),
+           min,
+           ticks / MICRO_TRIALS);
+    if (0 <= cycles) {
+        printf(", %7.2f cycles/op", core_cycles / MICRO_TRIALS);
+    }
+    printf("\n");
+}
+
+static Vec3 get_random_vec3(Rng* rng) {
+    return {
+        (get_random_f32(rng) * 2.0f) - 1.0f,
+        (get_random_f32(rng) * 2.0f) - 1.0f,
+        (get_random_f32(rng) * 2.0f) - 1.0f,
+    };
+}
+
+// NOTE: A single leaf of `MICRO_SPHERES` spheres around the origin, with rays
+// fired from outside it towards random points inside, so `get_nearest` sees
+// the usual mix of hits and misses.
+static void set_inputs(Inputs* inputs, Sphere* spheres, Surface* surfaces) {
+    Rng rng;
+    set_key(&rng, 0, 0, 0);
+    for (u32 i = 0; i < N_MATERIALS; ++i) {
+        surfaces[i] = {
+            {get_random_f32(&rng), get_random_f32(&rng), get_random_f32(&rng)},
+            {1.5f},
+            static_cast<Material>(i),
+        };
+    }
+    for (u32 i = 0; i < MICRO_SPHERES; ++i) {
+        spheres[i] = {
+            get_random_vec3(&rng) * 2.0f,
+            0.25f + (get_random_f32(&rng) * 0.5f),
+            i % N_MATERIALS,
+        };
+    }
+    for (u32 i = 0; i < MICRO_INPUTS; ++i) {
+        inputs->vectors[i] = get_random_vec3(&rng);
+        inputs->normals[i] = unit(get_random_vec3(&rng));
+        inputs->cosines[i] = get_random_f32(&rng);
+        const Vec3 origin = unit(get_random_vec3(&rng)) * 8.0f;
+        inputs->rays[i] = {origin, get_random_vec3(&rng) - origin};
+        inputs->t[i] = 4.0f + (get_random_f32(&rng) * 4.0f);
+        inputs->index[i] = get_random_u32(&rng) % MICRO_SPHERES;
+        set_key(&inputs->rngs[i], 0, i, 0);
+    }
+}
+
+i32 main(i32 n, const char** args) {
+    const char* filter = 1 < n ? args[1] : null;
+    Inputs*     inputs = reinterpret_cast<Inputs*>(alloc(sizeof(Inputs)));
+    Sphere      spheres[MICRO_SPHERES];
+    Surface     surfaces[N_MATERIALS];
+    set_inputs(inputs, spheres, surfaces);
+    u8* buffer = build_scene(spheres, MICRO_SPHERES, surfaces, N_MATERIALS);
+    Scene scene;
+    set_scene(&scene, buffer);
+    const i32 cycles = open_cycles();
+    printf("Ops/trial        : %u\n"
+           "Trials           : %u (%u warm-up)\n"
+           "Cycles           : %s\n"
+           "\n",
+           MICRO_OPS,
+           MICRO_TRIALS,
+           MICRO_WARMUP,
+           0 <= cycles ? "perf_event" : "unavailable");
+    for (u32 i = 0; i < N_MICROS; ++i) {
+        if (filter && !strstr(MICROS[i].name, filter)) {
+            continue;
+        }
+        run_micro(&MICROS[i], &scene, inputs, cycles);
+    }
+    if (0 <= cycles) {
+        close(cycles);
+    }
+    return EXIT_SUCCESS;
+}
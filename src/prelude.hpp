@@ -5,10 +5,15 @@
 #include <float.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -18,6 +23,7 @@ typedef size_t   usize;
 
 typedef int16_t i16;
 typedef int32_t i32;
+typedef int64_t i64;
 
 typedef float f32;
 
@@ -25,17 +31,58 @@ typedef FILE File;
 
 #define null nullptr
 
-typedef struct timeval TimeValue;
+#define INLINE inline __attribute__((always_inline))
+
+typedef struct timespec TimeSpec;
 
 typedef pthread_t            Thread;
+typedef pthread_barrier_t    Barrier;
+typedef pthread_attr_t       ThreadAttr;
+typedef cpu_set_t            CpuSet;
 typedef std::atomic_uint16_t u16Atomic;
+typedef std::atomic_uint32_t u32Atomic;
+typedef std::atomic_uint64_t u64Atomic;
 
 #define F32_MAX FLT_MAX
 
 #define SEQ_CST std::memory_order_seq_cst
+#define RELAXED std::memory_order_relaxed
+
+#define ARENA_ALIGN 64
+
+static void* alloc(usize size) {
+    void* memory = mmap(null,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE,
+                        -1,
+                        0);
+    if (memory == MAP_FAILED) {
+        _exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+// NOTE: A bump allocator over one `alloc` sized up front for the job;
+// everything pushed is released together by unmapping `buffer`.
+struct Arena {
+    u8*   buffer;
+    usize size;
+    usize offset;
+};
+
+static usize get_arena_size(usize size) {
+    return (size + (ARENA_ALIGN - 1)) & ~static_cast<usize>(ARENA_ALIGN - 1);
+}
 
-#define IMAGE_WIDTH  1280
-#define IMAGE_HEIGHT 512
-#define N_PIXELS     (IMAGE_WIDTH * IMAGE_HEIGHT)
+static INLINE void* push(Arena* arena, usize size) {
+    const usize offset = arena->offset + get_arena_size(size);
+    if (arena->size < offset) {
+        _exit(EXIT_FAILURE);
+    }
+    void* memory = &arena->buffer[arena->offset];
+    arena->offset = offset;
+    return memory;
+}
 
 #endif
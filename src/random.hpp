@@ -1,47 +1,146 @@
 #ifndef __RANDOM_H__
 #define __RANDOM_H__
 
-struct PcgRng {
-    u64 state;
-    u64 increment;
+#define RNG_WEYL 0x9E3779B97F4A7C15llu
+
+#define RNG_RANK_LEVELS 16
+
+enum Sampler {
+    SAMPLER_RANDOM = 0,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE,
+};
+
+// NOTE: Counter-based; every draw is a pure function of `key`, `index` and
+// its `dimension`, so any sample of any pixel can be regenerated on its own
+// regardless of which thread (or process) renders it. `index` is only read
+// by the Sobol samplers.
+struct Rng {
+    u64     key;
+    u32     index;
+    u32     dimension;
+    Sampler sampler;
 };
 
-static u32 get_random_u32(PcgRng* rng) {
-    const u64 state = rng->state;
-    rng->state = (state * 6364136223846793005llu) + (rng->increment | 1u);
-    const u32 xor_shift = static_cast<u32>(((state >> 18u) ^ state) >> 27u);
-    const u32 rotate = static_cast<u32>(state >> 59u);
-    return (xor_shift >> rotate) | (xor_shift << ((-rotate) & 31));
-}
-
-static void set_seed(PcgRng* rng, u64 state, u64 increment) {
-    rng->state = 0;
-    rng->increment = (increment << 1u) | 1u;
-    get_random_u32(rng);
-    rng->state += state;
-    get_random_u32(rng);
-}
-
-// NOTE: See `https://github.com/hfinkel/sleef-bgq/blob/master/purec/sleefsp.c#L117-L130`.
-static f32 ldexpf_(f32 x, i32 q) {
-    i32 m = q >> 31;
-    m = (((m + q) >> 6) - m) << 4;
-    q = q - (m << 2);
-    m += 127;
-    m = m < 0 ? 0 : m;
-    m = m > 255 ? 255 : m;
-    union {
-        f32 as_f32;
-        i32 as_i32;
-    } u;
-    u.as_i32 = m << 23;
-    x = x * u.as_f32 * u.as_f32 * u.as_f32 * u.as_f32;
-    u.as_i32 = (q + 0x7F) << 23;
-    return x * u.as_f32;
-}
-
-static f32 get_random_f32(PcgRng* rng) {
-    return ldexpf_(static_cast<f32>(get_random_u32(rng)), -32);
+static u64 get_mix(u64 x) {
+    x = (x ^ (x >> 30u)) * 0xBF58476D1CE4E5B9llu;
+    x = (x ^ (x >> 27u)) * 0x94D049BB133111EBllu;
+    return x ^ (x >> 31u);
+}
+
+static void set_key(Rng* rng, u64 seed, u32 pixel, u32 sample) {
+    rng->key =
+        get_mix(seed + get_mix((static_cast<u64>(pixel) << 32u) | sample));
+    rng->index = 0;
+    rng->dimension = 0;
+    rng->sampler = SAMPLER_RANDOM;
+}
+
+// NOTE: Each pixel walks its own Owen-scrambled Sobol sequence, so its
+// first `2^k` samples are stratified in every pair of dimensions.
+static INLINE void set_sobol(Rng* rng, u64 seed, u32 pixel, u32 sample) {
+    rng->key = get_mix(seed + get_mix(static_cast<u64>(pixel) + 1u));
+    rng->index = sample;
+    rng->dimension = 0;
+    rng->sampler = SAMPLER_SOBOL;
+}
+
+// NOTE: Orders pixels along a Morton curve whose four children at every
+// level are visited in a hashed order, after Ahmed and Wonka, "Screen-Space
+// Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical
+// Ordering of Pixels" (2020).
+static u32 get_rank(u64 seed, u32 x, u32 y) {
+    u32 rank = 0;
+    for (u32 level = RNG_RANK_LEVELS; level-- != 0;) {
+        const u32 digit = (((y >> level) & 1u) << 1u) | ((x >> level) & 1u);
+        const u64 node = seed ^ ((static_cast<u64>(level) << 32u) | rank);
+        rank = (rank << 2u) |
+               (digit ^ static_cast<u32>((node * RNG_WEYL) >> 62u));
+    }
+    return rank;
+}
+
+// NOTE: Consecutive pixels in `get_rank` order take consecutive blocks of
+// `2^sample_bits` samples from one shared sequence, which spreads the error
+// between neighbours as blue noise. Past 32 bits of index the high bits
+// pick a fresh scramble instead, so very large frames restart the sequence
+// every so many pixels.
+static INLINE void set_blue(Rng* rng,
+                            u64  seed,
+                            u32  x,
+                            u32  y,
+                            u32  sample,
+                            u32  sample_bits) {
+    const u64 index =
+        (static_cast<u64>(get_rank(seed, x, y)) << sample_bits) | sample;
+    rng->key = get_mix(seed + get_mix(index >> 32u));
+    rng->index = static_cast<u32>(index);
+    rng->dimension = 0;
+    rng->sampler = SAMPLER_BLUE;
+}
+
+static u32 get_random_u32(u64 key, u32 dimension) {
+    return static_cast<u32>(get_mix(key + (dimension * RNG_WEYL)) >> 32u);
+}
+
+static u32 reverse_bits(u32 x) {
+    x = __builtin_bswap32(x);
+    x = ((x >> 4u) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4u);
+    x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+    return ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+}
+
+// NOTE: From Burley, "Practical Hash-based Owen Scrambling" (2020); each
+// bit only flips depending on the bits below it, so applied to a reversed
+// value it is a nested uniform (Owen) scramble.
+static u32 get_laine_karras(u32 x, u32 seed) {
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return x;
+}
+
+// NOTE: Reversed, the first Sobol dimension is just `index` and the second
+// is `index` times Pascal's triangle mod 2. By Lucas' theorem bit `j` of
+// the latter is the parity of the set bits `k` of `index` that have `j` as
+// a bitwise subset, which five shift-and-mask steps sum for all `j` at once.
+static u32 get_reversed_sobol(u32 index, u32 dimension) {
+    if (dimension != 0) {
+        index ^= (index >> 1u) & 0x55555555u;
+        index ^= (index >> 2u) & 0x33333333u;
+        index ^= (index >> 4u) & 0x0F0F0F0Fu;
+        index ^= (index >> 8u) & 0x00FF00FFu;
+        index ^= (index >> 16u) & 0x0000FFFFu;
+    }
+    return index;
+}
+
+// NOTE: Dimensions are handed out in pairs. Both halves of a pair shuffle
+// `index` with the same Owen scramble, so they stay one 2D Sobol point (and
+// any power-of-two prefix of samples stays stratified), while every
+// dimension gets its own scramble of the value.
+static u32 get_sequence_u32(u64 key, u32 index, u32 dimension) {
+    const u64 pair = get_mix(key + ((dimension >> 1u) * RNG_WEYL));
+    const u32 shuffled = reverse_bits(
+        get_laine_karras(reverse_bits(index), static_cast<u32>(pair)));
+    return reverse_bits(get_laine_karras(
+        get_reversed_sobol(shuffled, dimension & 1u),
+        static_cast<u32>(get_mix(pair + (dimension & 1u)) >> 32u)));
+}
+
+static u32 get_random_u32(Rng* rng) {
+    if (rng->sampler == SAMPLER_RANDOM) {
+        return get_random_u32(rng->key, rng->dimension++);
+    }
+    return get_sequence_u32(rng->key, rng->index, rng->dimension++);
+}
+
+#define RNG_SCALE (1.0f / 16777216.0f)
+
+static f32 get_random_f32(Rng* rng) {
+    return static_cast<f32>(get_random_u32(rng) >> 8u) * RNG_SCALE;
 }
 
 #endif
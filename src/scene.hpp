@@ -0,0 +1,454 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SCENE_MAGIC   0x314E4353
+#define SCENE_VERSION 2
+#define SCENE_ALIGN   64
+#define SCENE_LINE    256
+
+typedef struct stat FileStatus;
+
+enum Material {
+    LAMBERTIAN = 0,
+    METAL,
+    DIELECTRIC,
+    EMISSIVE,
+};
+
+#define N_MATERIALS 4
+
+#define MATERIAL_BIT(material) (1u << (material))
+#define ALL_MATERIALS          ((1u << N_MATERIALS) - 1)
+
+union Features {
+    f32 fuzz;
+    f32 refractive_index;
+};
+
+// NOTE: An `EMISSIVE` surface scatters nothing; its `albedo` is the radiance
+// it gives off, which may well exceed one.
+struct Surface {
+    RgbColor albedo;
+    Features features;
+    Material material;
+};
+
+struct Sphere {
+    Vec3 center;
+    f32  radius;
+    u32  surface;
+};
+
+// NOTE: Offsets are in bytes from the start of the file, each aligned to
+// `SCENE_ALIGN`. Spheres are stored in BVH leaf order and the `f32` lane
+// arrays carry `SIMD_WIDTH - 1` trailing spheres that can never be hit, so
+// the whole file is used in place exactly as `set_scene` lays it out.
+// `lights` lists the emissive spheres by their index in that order.
+struct SceneHeader {
+    u32 magic;
+    u32 version;
+    u32 n_spheres;
+    u32 n_lanes;
+    u32 n_nodes;
+    u32 n_surfaces;
+    u32 n_lights;
+    u32 _;
+    u64 size;
+    u64 center_x;
+    u64 center_y;
+    u64 center_z;
+    u64 radius_squared;
+    u64 radius;
+    u64 surface;
+    u64 surfaces;
+    u64 lights;
+    u64 nodes;
+};
+
+enum SceneRecord {
+    RECORD_END = 0,
+    RECORD_SPHERE,
+    RECORD_SURFACE,
+};
+
+struct Scene {
+    const f32*     center_x;
+    const f32*     center_y;
+    const f32*     center_z;
+    const f32*     radius_squared;
+    const f32*     radius;
+    const u32*     surface;
+    const Surface* surfaces;
+    const u32*     lights;
+    Bvh            bvh;
+    u32            n_spheres;
+    u32            n_lights;
+};
+
+static u64 get_aligned(u64 offset) {
+    return (offset + (SCENE_ALIGN - 1)) & ~static_cast<u64>(SCENE_ALIGN - 1);
+}
+
+static u64 push_section(u64* offset, u64 size) {
+    const u64 section = *offset;
+    *offset = get_aligned(section + size);
+    return section;
+}
+
+static void set_layout(SceneHeader* header,
+                       u32          n_spheres,
+                       u32          n_surfaces,
+                       u32          n_lights) {
+    *header = {};
+    header->magic = SCENE_MAGIC;
+    header->version = SCENE_VERSION;
+    header->n_spheres = n_spheres;
+    header->n_lanes = n_spheres + SIMD_WIDTH - 1;
+    header->n_nodes = (2 * n_spheres) - 1;
+    header->n_surfaces = n_surfaces;
+    header->n_lights = n_lights;
+    u64 offset = get_aligned(sizeof(SceneHeader));
+    header->center_x = push_section(&offset, sizeof(f32) * header->n_lanes);
+    header->center_y = push_section(&offset, sizeof(f32) * header->n_lanes);
+    header->center_z = push_section(&offset, sizeof(f32) * header->n_lanes);
+    header->radius_squared =
+        push_section(&offset, sizeof(f32) * header->n_lanes);
+    header->radius = push_section(&offset, sizeof(f32) * n_spheres);
+    header->surface = push_section(&offset, sizeof(u32) * n_spheres);
+    header->surfaces = push_section(&offset, sizeof(Surface) * n_surfaces);
+    header->lights = push_section(&offset, sizeof(u32) * n_lights);
+    header->nodes = push_section(&offset, sizeof(BvhNode) * header->n_nodes);
+    header->size = offset;
+}
+
+static void set_scene(Scene* scene, u8* buffer) {
+    const SceneHeader* header = reinterpret_cast<const SceneHeader*>(buffer);
+    scene->center_x = reinterpret_cast<f32*>(&buffer[header->center_x]);
+    scene->center_y = reinterpret_cast<f32*>(&buffer[header->center_y]);
+    scene->center_z = reinterpret_cast<f32*>(&buffer[header->center_z]);
+    scene->radius_squared =
+        reinterpret_cast<f32*>(&buffer[header->radius_squared]);
+    scene->radius = reinterpret_cast<f32*>(&buffer[header->radius]);
+    scene->surface = reinterpret_cast<u32*>(&buffer[header->surface]);
+    scene->surfaces = reinterpret_cast<Surface*>(&buffer[header->surfaces]);
+    scene->lights = reinterpret_cast<u32*>(&buffer[header->lights]);
+    scene->bvh = {
+        reinterpret_cast<BvhNode*>(&buffer[header->nodes]),
+        null,
+        header->n_nodes,
+    };
+    scene->n_spheres = header->n_spheres;
+    scene->n_lights = header->n_lights;
+}
+
+// NOTE: Returns a buffer of `get_scene_size` bytes holding the header and
+// every section; the BVH is built here so that loading never has to.
+static u8* build_scene(const Sphere*  spheres,
+                       u32            n_spheres,
+                       const Surface* surfaces,
+                       u32            n_surfaces) {
+    u32 n_lights = 0;
+    for (u32 i = 0; i < n_spheres; ++i) {
+        if (surfaces[spheres[i].surface].material == EMISSIVE) {
+            ++n_lights;
+        }
+    }
+    SceneHeader header;
+    set_layout(&header, n_spheres, n_surfaces, n_lights);
+    u8*   buffer = reinterpret_cast<u8*>(alloc(header.size));
+    Aabb* bounds = reinterpret_cast<Aabb*>(alloc(sizeof(Aabb) * n_spheres));
+    Vec3* centroids =
+        reinterpret_cast<Vec3*>(alloc(sizeof(Vec3) * n_spheres));
+    u32* indices = reinterpret_cast<u32*>(alloc(sizeof(u32) * n_spheres));
+    for (u32 i = 0; i < n_spheres; ++i) {
+        const f32  radius = fabsf(spheres[i].radius);
+        const Vec3 extent = {radius, radius, radius};
+        bounds[i] = {
+            spheres[i].center - extent,
+            spheres[i].center + extent,
+        };
+    }
+    Bvh bvh = {
+        reinterpret_cast<BvhNode*>(&buffer[header.nodes]),
+        indices,
+        0,
+    };
+    set_bvh(&bvh, bounds, centroids, n_spheres);
+    header.n_nodes = bvh.n_nodes;
+    f32* center_x = reinterpret_cast<f32*>(&buffer[header.center_x]);
+    f32* center_y = reinterpret_cast<f32*>(&buffer[header.center_y]);
+    f32* center_z = reinterpret_cast<f32*>(&buffer[header.center_z]);
+    f32* radius_squared =
+        reinterpret_cast<f32*>(&buffer[header.radius_squared]);
+    f32* radius = reinterpret_cast<f32*>(&buffer[header.radius]);
+    u32* surface = reinterpret_cast<u32*>(&buffer[header.surface]);
+    u32* lights = reinterpret_cast<u32*>(&buffer[header.lights]);
+    n_lights = 0;
+    for (u32 i = 0; i < header.n_lanes; ++i) {
+        if (i < n_spheres) {
+            const Sphere* sphere = &spheres[indices[i]];
+            center_x[i] = sphere->center.x;
+            center_y[i] = sphere->center.y;
+            center_z[i] = sphere->center.z;
+            radius_squared[i] = sphere->radius * sphere->radius;
+            radius[i] = sphere->radius;
+            surface[i] = sphere->surface;
+            if (surfaces[sphere->surface].material == EMISSIVE) {
+                lights[n_lights++] = i;
+            }
+        } else {
+            radius_squared[i] = -1.0f;
+        }
+    }
+    memcpy(&buffer[header.surfaces], surfaces, sizeof(Surface) * n_surfaces);
+    memcpy(buffer, &header, sizeof(SceneHeader));
+    munmap(bounds, sizeof(Aabb) * n_spheres);
+    munmap(centroids, sizeof(Vec3) * n_spheres);
+    munmap(indices, sizeof(u32) * n_spheres);
+    return buffer;
+}
+
+static INLINE u32 get_materials(const Scene* scene) {
+    u32 materials = 0;
+    for (u32 i = 0; i < scene->n_spheres; ++i) {
+        materials |= MATERIAL_BIT(scene->surfaces[scene->surface[i]].material);
+    }
+    return materials;
+}
+
+static u64 get_scene_size(const u8* buffer) {
+    return reinterpret_cast<const SceneHeader*>(buffer)->size;
+}
+
+// NOTE: Checks everything a render indexes by a value read from the file:
+// materials, surface and light indices, BVH leaf ranges and the tree itself.
+static bool is_valid_scene(u8* buffer) {
+    const SceneHeader* header = reinterpret_cast<const SceneHeader*>(buffer);
+    Scene              scene;
+    set_scene(&scene, buffer);
+    for (u32 i = 0; i < header->n_surfaces; ++i) {
+        // NOTE: Read the raw bytes; an out-of-range enum value is not
+        // something the compiler lets us compare against.
+        u32 material = 0;
+        memcpy(&material, &scene.surfaces[i].material, sizeof(Material));
+        if (N_MATERIALS <= material) {
+            return false;
+        }
+    }
+    for (u32 i = 0; i < scene.n_spheres; ++i) {
+        if (header->n_surfaces <= scene.surface[i]) {
+            return false;
+        }
+    }
+    for (u32 i = 0; i < scene.n_lights; ++i) {
+        const u32 light = scene.lights[i];
+        if ((scene.n_spheres <= light) ||
+            (scene.surfaces[scene.surface[light]].material != EMISSIVE))
+        {
+            return false;
+        }
+    }
+    for (u32 i = 0; i < scene.bvh.n_nodes; ++i) {
+        const BvhNode* node = &scene.bvh.nodes[i];
+        if ((node->count != 0) && ((scene.n_spheres < node->offset) ||
+                                   ((scene.n_spheres - node->offset) <
+                                    node->count)))
+        {
+            return false;
+        }
+    }
+    return is_valid_bvh(scene.bvh.nodes, scene.bvh.n_nodes);
+}
+
+static INLINE u8* map_scene(const char* path) {
+    const i32 file = open(path, O_RDONLY);
+    if (file < 0) {
+        exit(EXIT_FAILURE);
+    }
+    FileStatus status;
+    if ((fstat(file, &status) != 0) ||
+        (static_cast<u64>(status.st_size) < sizeof(SceneHeader)))
+    {
+        exit(EXIT_FAILURE);
+    }
+    void* memory = mmap(null,
+                        static_cast<usize>(status.st_size),
+                        PROT_READ,
+                        MAP_PRIVATE,
+                        file,
+                        0);
+    close(file);
+    if (memory == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    u8*                buffer = reinterpret_cast<u8*>(memory);
+    const SceneHeader* header = reinterpret_cast<const SceneHeader*>(buffer);
+    SceneHeader        layout;
+    set_layout(&layout,
+               header->n_spheres,
+               header->n_surfaces,
+               header->n_lights);
+    if ((header->n_spheres == 0) || (header->n_surfaces == 0) ||
+        (header->n_spheres < header->n_lights) ||
+        (layout.n_nodes < header->n_nodes) ||
+        (layout.size != static_cast<u64>(status.st_size)))
+    {
+        exit(EXIT_FAILURE);
+    }
+    layout.n_nodes = header->n_nodes;
+    if ((memcmp(&layout, header, sizeof(SceneHeader)) != 0) ||
+        (header->n_nodes == 0) || !is_valid_scene(buffer))
+    {
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+// NOTE: One record per line, `#` starts a comment:
+//
+//     surface lambertian <red> <green> <blue>
+//     surface metal <red> <green> <blue> <fuzz>
+//     surface dielectric <refractive index>
+//     surface emissive <red> <green> <blue>
+//     sphere <x> <y> <z> <radius> <surface>
+//
+// where `<surface>` counts `surface` lines from zero. A negative radius
+// flips the normals, e.g. for the inside of a hollow glass sphere.
+static SceneRecord read_record(File* file, char* line) {
+    for (;;) {
+        if (!fgets(line, SCENE_LINE, file)) {
+            return RECORD_END;
+        }
+        char kind[16];
+        if ((sscanf(line, " %15s", kind) != 1) || (kind[0] == '#')) {
+            continue;
+        }
+        if (!strcmp(kind, "sphere")) {
+            return RECORD_SPHERE;
+        }
+        if (!strcmp(kind, "surface")) {
+            return RECORD_SURFACE;
+        }
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void read_sphere(const char* line, Sphere* sphere) {
+    if (sscanf(line,
+               " sphere %f %f %f %f %u",
+               &sphere->center.x,
+               &sphere->center.y,
+               &sphere->center.z,
+               &sphere->radius,
+               &sphere->surface) != 5)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void read_surface(const char* line, Surface* surface) {
+    char material[16];
+    if (sscanf(line, " surface %15s", material) != 1) {
+        exit(EXIT_FAILURE);
+    }
+    *surface = {};
+    RgbColor* albedo = &surface->albedo;
+    if (!strcmp(material, "lambertian")) {
+        surface->material = LAMBERTIAN;
+        if (sscanf(line,
+                   " surface %*s %f %f %f",
+                   &albedo->red,
+                   &albedo->green,
+                   &albedo->blue) != 3)
+        {
+            exit(EXIT_FAILURE);
+        }
+    } else if (!strcmp(material, "metal")) {
+        surface->material = METAL;
+        if (sscanf(line,
+                   " surface %*s %f %f %f %f",
+                   &albedo->red,
+                   &albedo->green,
+                   &albedo->blue,
+                   &surface->features.fuzz) != 4)
+        {
+            exit(EXIT_FAILURE);
+        }
+    } else if (!strcmp(material, "emissive")) {
+        surface->material = EMISSIVE;
+        if (sscanf(line,
+                   " surface %*s %f %f %f",
+                   &albedo->red,
+                   &albedo->green,
+                   &albedo->blue) != 3)
+        {
+            exit(EXIT_FAILURE);
+        }
+    } else if (!strcmp(material, "dielectric")) {
+        surface->material = DIELECTRIC;
+        if (sscanf(line,
+                   " surface %*s %f",
+                   &surface->features.refractive_index) != 1)
+        {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static INLINE void convert_scene(const char* text_path,
+                                 const char* scene_path) {
+    File* text = fopen(text_path, "r");
+    if (!text) {
+        exit(EXIT_FAILURE);
+    }
+    char        line[SCENE_LINE];
+    u32         n_spheres = 0;
+    u32         n_surfaces = 0;
+    SceneRecord record;
+    while ((record = read_record(text, line)) != RECORD_END) {
+        if (record == RECORD_SPHERE) {
+            ++n_spheres;
+        } else {
+            ++n_surfaces;
+        }
+    }
+    if ((n_spheres == 0) || (n_surfaces == 0)) {
+        exit(EXIT_FAILURE);
+    }
+    Sphere* spheres =
+        reinterpret_cast<Sphere*>(alloc(sizeof(Sphere) * n_spheres));
+    Surface* surfaces =
+        reinterpret_cast<Surface*>(alloc(sizeof(Surface) * n_surfaces));
+    rewind(text);
+    u32 i = 0;
+    u32 j = 0;
+    while ((record = read_record(text, line)) != RECORD_END) {
+        if (record == RECORD_SPHERE) {
+            read_sphere(line, &spheres[i]);
+            if (n_surfaces <= spheres[i++].surface) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            read_surface(line, &surfaces[j++]);
+        }
+    }
+    fclose(text);
+    u8*       buffer = build_scene(spheres, n_spheres, surfaces, n_surfaces);
+    const u64 size = get_scene_size(buffer);
+    File*     file = fopen(scene_path, "wb");
+    if ((!file) || (fwrite(buffer, 1, size, file) != size)) {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    munmap(buffer, size);
+    munmap(spheres, sizeof(Sphere) * n_spheres);
+    munmap(surfaces, sizeof(Surface) * n_surfaces);
+}
+
+#endif
@@ -0,0 +1,337 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <immintrin.h>
+
+#define SIMD_WIDTH 8
+
+#ifdef __AVX2__
+
+struct f32x8 {
+    __m256 v;
+};
+
+static f32x8 set1(f32 x) {
+    return {_mm256_set1_ps(x)};
+}
+
+static f32x8 load(const f32* x) {
+    return {_mm256_loadu_ps(x)};
+}
+
+static f32x8 set_bits(u32 x) {
+    return {_mm256_castsi256_ps(_mm256_set1_epi32(static_cast<i32>(x)))};
+}
+
+static f32x8 convert(const u32* x) {
+    return {_mm256_cvtepi32_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x)))};
+}
+
+static void store(f32* x, f32x8 a) {
+    _mm256_storeu_ps(x, a.v);
+}
+
+static INLINE void store_bits(u32* x, f32x8 a) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(x),
+                        _mm256_castps_si256(a.v));
+}
+
+static f32x8 operator+(f32x8 a, f32x8 b) {
+    return {_mm256_add_ps(a.v, b.v)};
+}
+
+static f32x8 operator-(f32x8 a, f32x8 b) {
+    return {_mm256_sub_ps(a.v, b.v)};
+}
+
+static f32x8 operator*(f32x8 a, f32x8 b) {
+    return {_mm256_mul_ps(a.v, b.v)};
+}
+
+static f32x8 operator/(f32x8 a, f32x8 b) {
+    return {_mm256_div_ps(a.v, b.v)};
+}
+
+static f32x8 operator&(f32x8 a, f32x8 b) {
+    return {_mm256_and_ps(a.v, b.v)};
+}
+
+static f32x8 operator<(f32x8 a, f32x8 b) {
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+
+static f32x8 operator<=(f32x8 a, f32x8 b) {
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)};
+}
+
+static f32x8 sqrt(f32x8 a) {
+    return {_mm256_sqrt_ps(a.v)};
+}
+
+static INLINE f32x8 min(f32x8 a, f32x8 b) {
+    return {_mm256_min_ps(a.v, b.v)};
+}
+
+static f32x8 max(f32x8 a, f32x8 b) {
+    return {_mm256_max_ps(a.v, b.v)};
+}
+
+static f32x8 select(f32x8 mask, f32x8 a, f32x8 b) {
+    return {_mm256_blendv_ps(b.v, a.v, mask.v)};
+}
+
+static u32 get_mask(f32x8 mask) {
+    return static_cast<u32>(_mm256_movemask_ps(mask.v));
+}
+
+static f32 get_min(f32x8 a) {
+    __m128 x = _mm_min_ps(_mm256_castps256_ps128(a.v),
+                          _mm256_extractf128_ps(a.v, 1));
+    x = _mm_min_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_min_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+static INLINE f32 get_max(f32x8 a) {
+    __m128 x = _mm_max_ps(_mm256_castps256_ps128(a.v),
+                          _mm256_extractf128_ps(a.v, 1));
+    x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_max_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+// NOTE: There is no 64-bit multiply below AVX-512, so it is put together
+// from three 32-bit ones; the high halves of the product are never needed.
+static __m256i get_product(__m256i a, u64 b) {
+    const __m256i b_lo = _mm256_set1_epi64x(static_cast<i64>(b & 0xFFFFFFFFu));
+    const __m256i b_hi = _mm256_set1_epi64x(static_cast<i64>(b >> 32u));
+    const __m256i cross =
+        _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b_lo),
+                         _mm256_mul_epu32(a, b_hi));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b_lo),
+                            _mm256_slli_epi64(cross, 32));
+}
+
+static __m256i get_mix(__m256i x) {
+    x = get_product(_mm256_xor_si256(x, _mm256_srli_epi64(x, 30)),
+                    0xBF58476D1CE4E5B9llu);
+    x = get_product(_mm256_xor_si256(x, _mm256_srli_epi64(x, 27)),
+                    0x94D049BB133111EBllu);
+    return _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+}
+
+// NOTE: `get_mix` of eight counters at once, keeping the top 24 bits of each
+// as `get_random_f32` does.
+static f32x8 get_mix_f32x8(const u64* x) {
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i lo = _mm256_permutevar8x32_epi32(
+        _mm256_srli_epi64(
+            get_mix(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x))),
+            40),
+        even);
+    const __m256i hi = _mm256_permutevar8x32_epi32(
+        _mm256_srli_epi64(get_mix(_mm256_loadu_si256(
+                              reinterpret_cast<const __m256i*>(x + 4))),
+                          40),
+        even);
+    return {_mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_blend_epi32(lo, hi, 0xF0)),
+        _mm256_set1_ps(RNG_SCALE))};
+}
+
+#else
+
+struct f32x8 {
+    __m128 lo;
+    __m128 hi;
+};
+
+static f32x8 set1(f32 x) {
+    return {_mm_set1_ps(x), _mm_set1_ps(x)};
+}
+
+static f32x8 load(const f32* x) {
+    return {_mm_loadu_ps(x), _mm_loadu_ps(x + 4)};
+}
+
+static f32x8 set_bits(u32 x) {
+    const __m128 bits = _mm_castsi128_ps(_mm_set1_epi32(static_cast<i32>(x)));
+    return {bits, bits};
+}
+
+static f32x8 convert(const u32* x) {
+    return {
+        _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x))),
+        _mm_cvtepi32_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 4))),
+    };
+}
+
+static void store(f32* x, f32x8 a) {
+    _mm_storeu_ps(x, a.lo);
+    _mm_storeu_ps(x + 4, a.hi);
+}
+
+static void store_bits(u32* x, f32x8 a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(x), _mm_castps_si128(a.lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(x + 4),
+                     _mm_castps_si128(a.hi));
+}
+
+static f32x8 operator+(f32x8 a, f32x8 b) {
+    return {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator-(f32x8 a, f32x8 b) {
+    return {_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator*(f32x8 a, f32x8 b) {
+    return {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator/(f32x8 a, f32x8 b) {
+    return {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator&(f32x8 a, f32x8 b) {
+    return {_mm_and_ps(a.lo, b.lo), _mm_and_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator<(f32x8 a, f32x8 b) {
+    return {_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi)};
+}
+
+static f32x8 operator<=(f32x8 a, f32x8 b) {
+    return {_mm_cmple_ps(a.lo, b.lo), _mm_cmple_ps(a.hi, b.hi)};
+}
+
+static f32x8 sqrt(f32x8 a) {
+    return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)};
+}
+
+static f32x8 min(f32x8 a, f32x8 b) {
+    return {_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)};
+}
+
+static f32x8 max(f32x8 a, f32x8 b) {
+    return {_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)};
+}
+
+static f32x8 select(f32x8 mask, f32x8 a, f32x8 b) {
+    return {
+        _mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+        _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)),
+    };
+}
+
+static u32 get_mask(f32x8 mask) {
+    return static_cast<u32>(_mm_movemask_ps(mask.lo) |
+                            (_mm_movemask_ps(mask.hi) << 4));
+}
+
+static f32 get_min(f32x8 a) {
+    __m128 x = _mm_min_ps(a.lo, a.hi);
+    x = _mm_min_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_min_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+static f32 get_max(f32x8 a) {
+    __m128 x = _mm_max_ps(a.lo, a.hi);
+    x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_max_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+static __m128i get_product(__m128i a, u64 b) {
+    const __m128i b_lo = _mm_set1_epi64x(static_cast<i64>(b & 0xFFFFFFFFu));
+    const __m128i b_hi = _mm_set1_epi64x(static_cast<i64>(b >> 32u));
+    const __m128i cross = _mm_add_epi64(
+        _mm_mul_epu32(_mm_srli_epi64(a, 32), b_lo), _mm_mul_epu32(a, b_hi));
+    return _mm_add_epi64(_mm_mul_epu32(a, b_lo), _mm_slli_epi64(cross, 32));
+}
+
+static __m128i get_mix(__m128i x) {
+    x = get_product(_mm_xor_si128(x, _mm_srli_epi64(x, 30)),
+                    0xBF58476D1CE4E5B9llu);
+    x = get_product(_mm_xor_si128(x, _mm_srli_epi64(x, 27)),
+                    0x94D049BB133111EBllu);
+    return _mm_xor_si128(x, _mm_srli_epi64(x, 31));
+}
+
+static __m128i get_mix_i32x4(const u64* x) {
+    const __m128i a = _mm_shuffle_epi32(
+        _mm_srli_epi64(
+            get_mix(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x))),
+            40),
+        _MM_SHUFFLE(3, 1, 2, 0));
+    const __m128i b = _mm_shuffle_epi32(
+        _mm_srli_epi64(
+            get_mix(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 2))),
+            40),
+        _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_unpacklo_epi64(a, b);
+}
+
+static f32x8 get_mix_f32x8(const u64* x) {
+    const __m128 scale = _mm_set1_ps(RNG_SCALE);
+    return {
+        _mm_mul_ps(_mm_cvtepi32_ps(get_mix_i32x4(x)), scale),
+        _mm_mul_ps(_mm_cvtepi32_ps(get_mix_i32x4(x + 4)), scale),
+    };
+}
+
+#endif
+
+static f32x8 operator-(f32x8 a) {
+    return set1(0.0f) - a;
+}
+
+static INLINE f32x8 abs(f32x8 a) {
+    return a & set_bits(0x7FFFFFFF);
+}
+
+static INLINE void get_sin_cos(f32x8 x, f32x8* sine, f32x8* cosine) {
+    const f32x8 h = x * set1(0.5f);
+    const f32x8 h2 = h * h;
+    f32x8       s = set1(SIN_9);
+    s = set1(SIN_7) + (h2 * s);
+    s = set1(SIN_5) + (h2 * s);
+    s = set1(SIN_3) + (h2 * s);
+    s = h * (set1(1.0f) + (h2 * s));
+    f32x8 c = set1(COS_10);
+    c = set1(COS_8) + (h2 * c);
+    c = set1(COS_6) + (h2 * c);
+    c = set1(COS_4) + (h2 * c);
+    c = set1(COS_2) + (h2 * c);
+    c = set1(1.0f) + (h2 * c);
+    *sine = set1(2.0f) * s * c;
+    *cosine = set1(1.0f) - (set1(2.0f) * s * s);
+}
+
+// NOTE: Lane `k` draws the next dimension of `rngs[k]`, so a batch yields
+// exactly what `get_random_f32` would have for each stream. Only the
+// counters are formed one lane at a time; the mix runs on all eight. The
+// Sobol samplers hash per lane instead.
+static INLINE f32x8 get_random_f32x8(Rng* rngs) {
+    u32 sequence = 0;
+    for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+        sequence |= rngs[k].sampler != SAMPLER_RANDOM;
+    }
+    if (sequence) {
+        u32 bits[SIMD_WIDTH];
+        for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+            bits[k] = get_random_u32(&rngs[k]) >> 8u;
+        }
+        return convert(bits) * set1(RNG_SCALE);
+    }
+    u64 counters[SIMD_WIDTH];
+    for (u32 k = 0; k < SIMD_WIDTH; ++k) {
+        counters[k] = rngs[k].key + (rngs[k].dimension++ * RNG_WEYL);
+    }
+    return get_mix_f32x8(counters);
+}
+
+#endif